@@ -17,69 +17,100 @@ T mapRange(T value, T oldMin, T oldMax, T newMin, T newMax) {
 }
 
 Graph::~Graph() {
+	destroy();
+}
+
+// Release the GL objects of the graph
+void Graph::destroy() {
+	// Cancel any evaluation still running and wait for the workers to let go of the stream buffer
+	++generation;
+	pool.wait();
+	{
+		std::lock_guard<std::mutex> lock(finishedMutex);
+		finishedJob.reset();
+	}
+	stream.create(0);
+	// Nothing left to delete if the graph was never built or is already destroyed
+	if (vaoID == 0) {
+		return;
+	}
 	glDeleteVertexArrays(1, &vaoID);
-	glDeleteBuffers(1, &vboID);
 	glDeleteBuffers(1, &iboID);
-	glDeleteBuffers(1, &height1ID);
-	glDeleteBuffers(1, &height2ID);
+	glDeleteTextures(1, &heightsID);
+	glDeleteBuffers(1, &normal1ID);
+	glDeleteBuffers(1, &normal2ID);
+	vaoID = iboID = heightsID = normal1ID = normal2ID = 0;
 }
 
 // Create a flat n * n grid on the XZ plane
+// The vertex shader places each vertex from its index and fetches its heights from a texture, so only the indices and
+// the normals live in buffers. Building again at another resolution reuses the buffers and the texture
 void Graph::build(int n) {
 	res = n;
-	// Vertices
-	for (int i = 0; i <= res; i++) {
-		for (int j = 0; j <= res; j++) {
-			// X
-			vertices.push_back(((float)j / (float)res) - 0.5f); // X, offset by 0.5 so 0,0,0 is the middle
-			// Y
-			vertices.push_back(0.0f);
-			// Z
-			vertices.push_back(((float)i / (float)res) - 0.5f); // Z, offset by 0.5 offset so 0,0,0 is the middle
-		}
-	}
-	// Indices
-	for (int i = 0; i < res; i++) {
-		for (int j = 0; j < res; j++) {
+	// Indices, a triangle strip per row of each band of columns with a restart after each
+	// Bands are narrow enough that the vertices a strip shares with the next stay in the vertex cache
+	size_t bands = (res + bandColumns - 1) / bandColumns;
+	std::vector<GLuint> indices;
+	indices.reserve(((size_t)res * 2 + bands * 3) * res);
+	for (int band = 0; band < res; band += bandColumns) {
+		for (int i = 0; i < res; i++) {
 			int row1 = i * (res + 1);
 			int row2 = (i + 1) * (res + 1);
-			// triangle 1
-			indices.push_back(row1 + j);
-			indices.push_back(row1 + j + 1);
-			indices.push_back(row2 + j + 1);
-			// triangle 2
-			indices.push_back(row1 + j);
-			indices.push_back(row2 + j + 1);
-			indices.push_back(row2 + j);
+			for (int j = band; j <= std::min(res, band + bandColumns); j++) {
+				indices.push_back(row2 + j);
+				indices.push_back(row1 + j);
+			}
+			indices.push_back(0xFFFFFFFF);
 		}
 	}
-	// Generate IDs for VBO, IBO, VAO
-	glGenVertexArrays(1, &vaoID);
-	glGenBuffers(1, &vboID);
-	glGenBuffers(1, &iboID);
+	indexCount = (GLsizei)indices.size();
+	// 16 bit indices while every vertex and the restart index fit
+	indexType = (size_t)(res + 1) * (res + 1) < 0xFFFF ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	// Generate IDs for IBO, VAO, heights and normals the first time
+	if (vaoID == 0) {
+		glGenVertexArrays(1, &vaoID);
+		glGenBuffers(1, &iboID);
+		glGenTextures(1, &heightsID);
+		glGenBuffers(1, &normal1ID);
+		glGenBuffers(1, &normal2ID);
+	}
 	// Bind vertx array
 	glBindVertexArray(vaoID);
-	// Copy vertex data
-	glBindBuffer(GL_ARRAY_BUFFER, vboID);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
 	// Copy indices
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboID);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
-	// Vertex attrib pointers
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(0);
-	// Generate buffers for the heights TEST
-	glGenBuffers(1, &height1ID);
-	glGenBuffers(1, &height2ID);
-	heights = std::vector<GLfloat>(res * res, 0); // Reserve space
-	glBindBuffer(GL_ARRAY_BUFFER, height1ID);
-	glBufferData(GL_ARRAY_BUFFER, heights.size() * sizeof(GLfloat), heights.data(), GL_STATIC_DRAW);
-	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(1);
-	glBindBuffer(GL_ARRAY_BUFFER, height2ID);
-	glBufferData(GL_ARRAY_BUFFER, heights.size() * sizeof(GLfloat), heights.data(), GL_STATIC_DRAW);
-	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(2);
+	if (indexType == GL_UNSIGNED_SHORT) {
+		std::vector<GLushort> shortIndices(indices.begin(), indices.end());
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(GLushort), shortIndices.data(), GL_STATIC_DRAW);
+	} else {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+	}
+	// Flat heights, one texel per vertex and one layer per height, stored offset by 0.5 into [0, 1]
+	size_t count = (size_t)(res + 1) * (res + 1);
+	quantized = quantizeHeights;
+	glBindTexture(GL_TEXTURE_2D_ARRAY, heightsID);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, quantized ? GL_R16 : GL_R32F, res + 1, res + 1, 2, 0, GL_RED, quantized ? GL_UNSIGNED_SHORT : GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	std::vector<GLfloat> heights(count, 0.5f);
+	std::vector<GLushort> quantizedHeights(count, quantize(0.0f));
+	for (int layer = 0; layer < 2; layer++) {
+		uploadHeights(layer, 0, 0, res + 1, res + 1, quantized ? (const void*)quantizedHeights.data() : (const void*)heights.data());
+	}
+	// Normals pointing up while flat
+	std::vector<GLfloat> normals(count * 3, 0);
+	for (size_t i = 0; i < count; i++) {
+		normals[i * 3 + 1] = 1.0f;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, normal1ID);
+	glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(GLfloat), normals.data(), GL_STATIC_DRAW);
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ARRAY_BUFFER, normal2ID);
+	glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(GLfloat), normals.data(), GL_STATIC_DRAW);
+	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(4);
 	// Deselect
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
@@ -87,54 +118,242 @@ void Graph::build(int n) {
 // Render the object
 void Graph::render() {
 	glBindVertexArray(vaoID);
-	glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, nullptr);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, heightsID);
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(indexType == GL_UNSIGNED_SHORT ? 0xFFFF : 0xFFFFFFFF);
+	glDrawElements(GL_TRIANGLE_STRIP, indexCount, indexType, nullptr);
+	glDisable(GL_PRIMITIVE_RESTART);
+}
+
+// Get the resolution of the grid
+int Graph::getRes() {
+	return res;
+}
+
+// Upload a rectangle of heights into a layer of the height texture
+void Graph::uploadHeights(int layer, int x, int y, int width, int height, const void* data) {
+	glBindTexture(GL_TEXTURE_2D_ARRAY, heightsID);
+	// Rows of the rectangle are rows of the whole grid apart, with no padding between them
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, res + 1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, layer, width, height, 1, GL_RED, quantized ? GL_UNSIGNED_SHORT : GL_FLOAT, data);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// Store a height as a 16 bit normalized integer, the height offset by 0.5 to the nearest of 65536 steps over [0, 1]
+GLushort Graph::quantize(float height) {
+	return (GLushort)((height + 0.5f) * 65535.0f + 0.5f);
+}
+
+// Map a value of the expression to a height of the graph
+float Graph::toHeight(const HeightJob& job, float value) {
+	return clip(mapRange(value, job.rangeY.x, job.rangeY.y, -1.0f, 1.0f), -0.4999f, 0.4999f);
+}
+
+// Write the normal of the graph at a value of the expression
+void Graph::toNormal(const HeightJob& job, float value, float dx, float dy, GLfloat* normal) {
+	// Slope of the height along the grid, zero where the height is clipped
+	float mapped = mapRange(value, job.rangeY.x, job.rangeY.y, -1.0f, 1.0f);
+	float scale = std::abs(mapped) < 0.4999f ? 2.0f / (job.rangeY.y - job.rangeY.x) : 0.0f;
+	float slopeX = scale * dx * (job.rangeX.y - job.rangeX.x);
+	float slopeZ = scale * dy * (job.rangeZ.y - job.rangeZ.x);
+	if (!std::isfinite(slopeX) || !std::isfinite(slopeZ)) {
+		slopeX = 0.0f;
+		slopeZ = 0.0f;
+	}
+	glm::vec3 n = glm::normalize(glm::vec3(-slopeX, 1.0f, -slopeZ));
+	normal[0] = n.x;
+	normal[1] = n.y;
+	normal[2] = n.z;
+}
+
+// Solve a tile of rows of a job on a worker
+void Graph::solveTile(std::shared_ptr<HeightJob> job, size_t tile, unsigned int worker) {
+	typedef ExprUtil::ExprFloat::Interval Interval;
+	ExprUtil::ExprFloat::Context& context = job->contexts[worker];
+	size_t rows = job->res + 1;
+	size_t begin = tile * tileRows;
+	size_t end = std::min(rows, begin + tileRows);
+	GLfloat yBegin = lerp(job->rangeZ.x, job->rangeZ.y, (float)begin / (float)job->res);
+	GLfloat yEnd = lerp(job->rangeZ.x, job->rangeZ.y, (float)(end - 1) / (float)job->res);
+	// Bound each block of columns first, blocks entirely above or below the graph or provably flat
+	// get a single height instead of solving every point
+	size_t blocks = (rows + tileRows - 1) / tileRows;
+	std::vector<GLfloat> fill(blocks);
+	std::vector<bool> solve(blocks);
+	std::vector<GLfloat> dx(rows), dy(rows);
+	// Quantized heights are solved into a row of floats first
+	std::vector<GLfloat> values(job->quantized ? rows : 0);
+	ExprUtil::ExprFloat::Slot inputs[2] = { job->slotX, job->slotY };
+	for (size_t b = 0; b < blocks; b++) {
+		// A cancelled tile skips the bounds too, the loop over the rows below then stops at once
+		if (job->generation != generation) {
+			break;
+		}
+		GLfloat xBegin = job->rowX[b * tileRows];
+		GLfloat xEnd = job->rowX[std::min(rows, (b + 1) * tileRows) - 1];
+		Interval ranges[2] = { { std::min(xBegin, xEnd), std::max(xBegin, xEnd) }, { std::min(yBegin, yEnd), std::max(yBegin, yEnd) } };
+		Interval range = job->expression.solveInterval(context, inputs, ranges, 2);
+		GLfloat lo = toHeight(*job, range.lo);
+		GLfloat hi = toHeight(*job, range.hi);
+		solve[b] = std::isnan(range.lo) || std::abs(hi - lo) > flatness;
+		fill[b] = lo + (hi - lo) / 2;
+	}
+	for (size_t i = begin; i < end; i++) {
+		// Stop as soon as a newer request comes in
+		if (job->generation != generation) {
+			break;
+		}
+		// Solve a row at a time straight into the buffer, parts that depend only on y are solved once for the row
+		// The derivatives come out of the same pass and give the normals, which runs as native code unless the
+		// expression loops or the platform has no JIT
+		GLfloat* row = job->quantized ? values.data() : (GLfloat*)job->heightData + i * rows;
+		GLfloat* normalRow = &job->normalData[i * rows * 3];
+		GLfloat y = lerp(job->rangeZ.x, job->rangeZ.y, (float)i / (float)job->res);
+		for (size_t b = 0; b < blocks;) {
+			size_t first = b * tileRows;
+			if (!solve[b]) {
+				size_t last = std::min(rows, first + tileRows);
+				std::fill(row + first, row + last, fill[b]);
+				for (size_t j = first; j < last; j++) {
+					toNormal(*job, 0.0f, 0.0f, 0.0f, &normalRow[j * 3]);
+				}
+				b++;
+				continue;
+			}
+			// Solve neighbouring blocks in one go
+			while (b < blocks && solve[b]) {
+				b++;
+			}
+			size_t last = std::min(rows, b * tileRows);
+			job->expression.solveGrid(context, job->grid, &y, 1, first, last - first, row + first, &dx[first], &dy[first]);
+			for (size_t j = first; j < last; j++) {
+				toNormal(*job, row[j], dx[j], dy[j], &normalRow[j * 3]);
+				row[j] = toHeight(*job, row[j]);
+			}
+		}
+		// Store the row the way the height texture holds it
+		if (job->quantized) {
+			GLushort* quantizedRow = (GLushort*)job->heightData + i * rows;
+			for (size_t j = 0; j < rows; j++) {
+				quantizedRow[j] = quantize(row[j]);
+			}
+		} else {
+			for (size_t j = 0; j < rows; j++) {
+				row[j] += 0.5f;
+			}
+		}
+	}
+	// The last tile hands the job over to the render thread
+	if (--job->tilesRemaining == 0 && job->generation == generation) {
+		std::lock_guard<std::mutex> lock(finishedMutex);
+		finishedJob = job;
+	}
 }
 
 // Set the expression that the graph displays
 void Graph::setHeights() {
-	// Heights
-	heights.clear();
-	for (size_t i = 0; i <= res; i++) {
-		for (size_t j = 0; j <= res; j++) {
-			expression.variables["x"] = lerp(rangeX.x, rangeX.y, (float)j / (float)res);
-			expression.variables["y"] = lerp(rangeZ.x, rangeZ.y, (float)i / (float)res);
-			heights.push_back(clip(mapRange(expression.solve(), rangeY.x, rangeY.y, -1.0f, 1.0f), -0.4999f, 0.4999f));
-		}
+	// Copy everything the job needs so the graph can keep changing while it runs
+	std::shared_ptr<HeightJob> job = std::make_shared<HeightJob>(expression);
+	job->generation = ++generation;
+	job->slotX = slotX;
+	job->slotY = slotY;
+	job->rangeX = rangeX;
+	job->rangeY = rangeY;
+	job->rangeZ = rangeZ;
+	job->res = res;
+	// X is the same for every row, so everything that depends only on x is solved here once per column
+	size_t rows = res + 1;
+	job->rowX.resize(rows);
+	for (size_t j = 0; j < rows; j++) {
+		job->rowX[j] = lerp(rangeX.x, rangeX.y, (float)j / (float)res);
+	}
+	// Write straight into the stream buffer, making it again if the grid has grown and no job still writes the old one
+	// Normals follow the heights at a multiple of 4 bytes
+	job->quantized = quantized;
+	job->heightBytes = (rows * rows * (quantized ? sizeof(GLushort) : sizeof(GLfloat)) + 3) / 4 * 4;
+	size_t bytes = job->heightBytes + rows * rows * 3 * sizeof(GLfloat);
+	if (streamSupported && stream.size() < bytes && !stream.busy()) {
+		streamSupported = stream.create(bytes);
+	}
+	job->region = stream.size() >= bytes ? stream.acquire() : -1;
+	if (job->region >= 0) {
+		job->stream = &stream;
+		job->heightData = stream.data(job->region);
+		job->normalData = (GLfloat*)((char*)job->heightData + job->heightBytes);
+	} else {
+		job->heights.resize(job->heightBytes);
+		job->normals.resize(rows * rows * 3);
+		job->heightData = job->heights.data();
+		job->normalData = job->normals.data();
+	}
+	job->contexts.assign(pool.size(), job->expression.makeContext());
+	job->grid = job->expression.makeGrid(job->contexts[0], slotX, job->rowX.data(), rows, slotY);
+	// Split the grid into tiles of rows for the workers
+	size_t tiles = (rows + tileRows - 1) / tileRows;
+	job->tilesRemaining = tiles;
+	for (size_t tile = 0; tile < tiles; tile++) {
+		pool.enqueue([this, job, tile](unsigned int worker) {
+			solveTile(job, tile, worker);
+		});
+	}
+}
+
+// Upload the heights once they are ready
+bool Graph::update() {
+	std::shared_ptr<HeightJob> job;
+	{
+		std::lock_guard<std::mutex> lock(finishedMutex);
+		job.swap(finishedJob);
+	}
+	// Nothing finished, or it was superseded after finishing or solved for a grid since rebuilt
+	if (!job || job->generation != generation || job->res != res || job->quantized != quantized) {
+		return false;
 	}
 	// Toggle height
 	height1Set = !height1Set;
-	// Check which height
-	if (!height1Set) {
-		// Send to height 1
-		glBindBuffer(GL_ARRAY_BUFFER, height1ID);
-		glBufferData(GL_ARRAY_BUFFER, heights.size() * sizeof(GLfloat), heights.data(), GL_STATIC_DRAW);
-		glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, 0);
-		glEnableVertexAttribArray(1);
-	} else {
-		// Send to height 2
-		glBindBuffer(GL_ARRAY_BUFFER, height2ID);
-		glBufferData(GL_ARRAY_BUFFER, heights.size() * sizeof(GLfloat), heights.data(), GL_STATIC_DRAW);
-		glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, 0);
-		glEnableVertexAttribArray(2);
+	// Send to height 1 or 2, the grid is the same size so the storage is only written to
+	size_t count = (size_t)(res + 1) * (res + 1);
+	GLuint normalID = height1Set ? normal2ID : normal1ID;
+	if (job->region >= 0) {
+		// Copied on the GPU from the region the workers wrote, which is fenced until these copies are done
+		size_t offset = stream.offset(job->region);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream.id());
+		uploadHeights(height1Set ? 1 : 0, 0, 0, res + 1, res + 1, (const void*)offset);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glBindBuffer(GL_COPY_READ_BUFFER, stream.id());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, normalID);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset + job->heightBytes, 0, count * 3 * sizeof(GLfloat));
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		stream.fence(job->region);
+		return true;
 	}
+	uploadHeights(height1Set ? 1 : 0, 0, 0, res + 1, res + 1, job->heightData);
+	glBindBuffer(GL_ARRAY_BUFFER, normalID);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, count * 3 * sizeof(GLfloat), job->normalData);
 	// Deselect
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return true;
 }
 
 // Set expression
 bool Graph::setExpression(std::string expr) {
-	// Set expression
+	// Set expression, heights only need to be accurate to well below a pixel
+	expression.accuracy = ExprUtil::Accuracy::Fast;
 	expression.set(expr);
-	// Check if the function is valid
-	expression.variables["x"] = 0;
-	expression.variables["y"] = 0;
-	if (!expression.isValid()) {
+	// Bind the grid variables, then check if the function is valid
+	slotX = expression.bind("x");
+	slotY = expression.bind("y");
+	ExprUtil::ExprFloat::Diagnostic diagnostic = expression.validate();
+	if (!diagnostic.ok()) {
+		std::cout << "ERROR::EXPRUTIL: " << diagnostic.message << " At character " << diagnostic.position + 1 << ".\n";
 		return false;
 	}
 	return true;
 }
 
-
 // Set X range
 void Graph::setRangeX(glm::vec2 range) {
 	rangeX = range;
@@ -7,31 +7,113 @@
 #include <GLFW/glfw3.h>
 #include <glm.hpp>
 // STD
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
 #include <vector>
 // User
 #include "exprutil.hpp"
+#include "StreamBuffer.hpp"
+#include "ThreadPool.hpp"
 
 class Graph {
 private:
-	GLuint vboID, iboID, vaoID;
-	GLuint height1ID, height2ID;
-	std::vector<GLfloat> vertices;
-	std::vector<GLuint> indices;
+	GLuint iboID = 0, vaoID = 0;
+	// Heights 1 and 2 as layers 0 and 1 of a float texture array, one texel per vertex
+	GLuint heightsID = 0;
+	GLuint normal1ID = 0, normal2ID = 0;
+	// Indices of the strips, 16 bit when the grid is small enough
+	GLsizei indexCount = 0;
+	GLenum indexType = GL_UNSIGNED_INT;
 	glm::vec2 rangeX = glm::vec2(-5.0f, 5.0f);
 	glm::vec2 rangeY = glm::vec2(-5.0f, 5.0f);
 	glm::vec2 rangeZ = glm::vec2(-5.0f, 5.0f);
-	std::vector<GLfloat> heights;
+	// Heights are stored as 16 bit normalized integers rather than floats, as of the last build()
+	bool quantized = false;
 	ExprUtil::ExprFloat expression;
+	ExprUtil::ExprFloat::Slot slotX = 0, slotY = 0;
 	int res = 0;
+	// Heights being evaluated in the background for one call to setHeights()
+	struct HeightJob {
+		unsigned int generation = 0;
+		ExprUtil::ExprFloat expression;
+		ExprUtil::ExprFloat::Slot slotX = 0, slotY = 0;
+		glm::vec2 rangeX, rangeY, rangeZ;
+		int res = 0;
+		bool quantized = false;
+		std::vector<GLfloat> rowX;
+		// Expression split over the grid, with everything that depends only on x already solved
+		ExprUtil::ExprFloat::Grid grid;
+		// Where the workers write the heights and then the normals, a region of the stream buffer or else the vectors
+		StreamBuffer* stream = nullptr;
+		int region = -1;
+		// Heights are stored as the texture holds them, GLushort or GLfloat, and take up heightBytes
+		void* heightData = nullptr;
+		GLfloat* normalData = nullptr;
+		size_t heightBytes = 0;
+		std::vector<char> heights;
+		std::vector<GLfloat> normals;
+		// One context per worker
+		std::vector<ExprUtil::ExprFloat::Context> contexts;
+		std::atomic<size_t> tilesRemaining{ 0 };
+		HeightJob(const ExprUtil::ExprFloat& expression) : expression(expression) {}
+		// Hand the region back once the last task lets go of the job
+		~HeightJob() {
+			if (region >= 0) {
+				stream->release(region);
+			}
+		}
+	};
+	// Persistently mapped ring the workers write heights and normals straight into, jobs fall back to vectors without it
+	// Declared before the jobs so it outlives them
+	StreamBuffer stream;
+	bool streamSupported = true;
+	// Latest call to setHeights(), older jobs skip their remaining work
+	std::atomic<unsigned int> generation{ 0 };
+	// Finished job waiting for update() to upload it
+	std::mutex finishedMutex;
+	std::shared_ptr<HeightJob> finishedJob;
+	// Columns in a band of strips, both rows of a band fit a 16 entry vertex cache
+	static const int bandColumns = 6;
+	// Rows of the grid handed to a worker at a time, tiles are bounded in blocks of as many columns
+	static const int tileRows = 16;
+	// Blocks whose heights provably vary less than this are filled with a single height
+	static constexpr float flatness = 1.0f / 4096.0f;
+	// Workers evaluating the heights, declared last so they are joined before the members they use are destroyed
+	ThreadPool pool;
+	// Store a height as a 16 bit normalized integer
+	static GLushort quantize(float height);
+	// Map a value of the expression to a height of the graph
+	static float toHeight(const HeightJob& job, float value);
+	// Write the normal of the graph at a value of the expression with partial derivatives dx and dy
+	static void toNormal(const HeightJob& job, float value, float dx, float dy, GLfloat* normal);
+	// Upload a width x height rectangle of heights at x, y into a layer of the height texture
+	// Heights are offset by 0.5 into [0, 1] and stored as GLushort if quantized or else GLfloat
+	// data points at the first height of the rectangle in a grid of res + 1 heights per row, or is an offset into the
+	// bound pixel unpack buffer
+	void uploadHeights(int layer, int x, int y, int width, int height, const void* data);
+	// Solve a tile of rows of a job on a worker
+	void solveTile(std::shared_ptr<HeightJob> job, size_t tile, unsigned int worker);
 public:
 	bool height1Set = false;
+	// Store heights as 16 bit normalized integers, steps of 1 / 65535 for half the upload of floats
+	// Takes effect at the next build()
+	bool quantizeHeights = true;
 	~Graph();
-	// Create an n x n grid on the XZ plane
+	// Release the GL objects of the graph while the context is still current, build() makes them again
+	// The global graph outlives glfwTerminate(), so this must be called before it
+	void destroy();
+	// Create an n x n grid on the XZ plane, or resize it
 	void build(int n);
+	// Get the resolution of the grid, the graph shader needs it as res to place the vertices
+	int getRes();
 	// Render the object
 	void render();
-	// Set the expression
+	// Start evaluating the heights in the background, cancelling any evaluation still running
 	void setHeights();
+	// Upload the heights once they are ready, returns true if new heights were uploaded
+	bool update();
 	// Set the expression
 	bool setExpression(std::string expr);
 	// Set X range
@@ -0,0 +1,125 @@
+#include "StreamBuffer.hpp"
+
+// Not in the OpenGL 3.3 loader, glBufferStorage is fetched from the context when first needed
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP BufferStorageProc)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+StreamBuffer::~StreamBuffer() {
+	create(0);
+}
+
+// Create the buffer with regions of size bytes
+bool StreamBuffer::create(size_t size) {
+	// Drop the previous buffer
+	for (int i = 0; i < regions; i++) {
+		if (fences[i] != nullptr) {
+			glDeleteSync(fences[i]);
+			fences[i] = nullptr;
+		}
+	}
+	if (bufferID != 0) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, bufferID);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		glDeleteBuffers(1, &bufferID);
+		bufferID = 0;
+	}
+	mapped = nullptr;
+	regionSize = 0;
+	next = 0;
+	if (size == 0) {
+		return true;
+	}
+	BufferStorageProc bufferStorage = (BufferStorageProc)glfwGetProcAddress("glBufferStorage");
+	if (bufferStorage == nullptr) {
+		return false;
+	}
+	// Written through the mapping only, coherent so writes need no flush before the commands reading them
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &bufferID);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, bufferID);
+	bufferStorage(GL_COPY_WRITE_BUFFER, size * regions, nullptr, flags);
+	mapped = (char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size * regions, flags);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	if (mapped == nullptr) {
+		glDeleteBuffers(1, &bufferID);
+		bufferID = 0;
+		return false;
+	}
+	regionSize = size;
+	return true;
+}
+
+// Bytes in each region
+size_t StreamBuffer::size() const {
+	return regionSize;
+}
+
+// Is any region claimed
+bool StreamBuffer::busy() const {
+	for (int i = 0; i < regions; i++) {
+		if (claimed[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Claim the next free region for writing
+int StreamBuffer::acquire() {
+	if (mapped == nullptr) {
+		return -1;
+	}
+	for (int i = 0; i < regions; i++) {
+		int region = (next + i) % regions;
+		if (claimed[region]) {
+			continue;
+		}
+		// The region was last read at least a frame ago, so this rarely waits
+		if (fences[region] != nullptr) {
+			GLenum status;
+			do {
+				status = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+			} while (status == GL_TIMEOUT_EXPIRED);
+			glDeleteSync(fences[region]);
+			fences[region] = nullptr;
+		}
+		claimed[region] = true;
+		next = (region + 1) % regions;
+		return region;
+	}
+	return -1;
+}
+
+// Pointer to the start of a region
+void* StreamBuffer::data(int region) const {
+	return mapped + offset(region);
+}
+
+// Offset of a region in the buffer
+size_t StreamBuffer::offset(int region) const {
+	return regionSize * region;
+}
+
+// Buffer ID
+GLuint StreamBuffer::id() const {
+	return bufferID;
+}
+
+// Fence a region after issuing the commands that read it
+void StreamBuffer::fence(int region) {
+	if (fences[region] != nullptr) {
+		glDeleteSync(fences[region]);
+	}
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Give a region back
+void StreamBuffer::release(int region) {
+	claimed[region] = false;
+}
@@ -0,0 +1,49 @@
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+// GL
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+// STD
+#include <atomic>
+#include <cstddef>
+
+// Buffer mapped once for good and split into regions, the CPU writes one region while the GPU reads the others
+// A region is claimed by whoever writes it, fenced once the commands reading it are issued and waited on before it is
+// claimed again. Needs glBufferStorage, OpenGL 4.4 or ARB_buffer_storage
+class StreamBuffer {
+public:
+	// Regions in the ring, one being written, one being read and one to spare
+	static const int regions = 3;
+private:
+	GLuint bufferID = 0;
+	char* mapped = nullptr;
+	size_t regionSize = 0;
+	GLsync fences[regions] = {};
+	std::atomic<bool> claimed[regions] = {};
+	int next = 0;
+public:
+	~StreamBuffer();
+	// Create the buffer with regions of size bytes, replacing any previous one, which must not be busy
+	// Returns false if the context cannot map buffers persistently, the buffer is then left empty
+	bool create(size_t size);
+	// Bytes in each region, 0 if there is no buffer
+	size_t size() const;
+	// Is any region claimed
+	bool busy() const;
+	// Claim the next free region for writing, waiting for the GPU to finish reading it first
+	// Returns -1 if every region is claimed or there is no buffer
+	int acquire();
+	// Pointer to the start of a region
+	void* data(int region) const;
+	// Offset of a region in the buffer, for commands reading it
+	size_t offset(int region) const;
+	// Buffer ID, for binding
+	GLuint id() const;
+	// Fence a region after issuing the commands that read it
+	void fence(int region);
+	// Give a region back once nothing writes it anymore, safe from any thread
+	void release(int region);
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+// Take tasks from the queue until the pool is destroyed
+void ThreadPool::work(unsigned int worker) {
+	while (true) {
+		std::function<void(unsigned int)> task;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueCondition.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty()) {
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop();
+			active++;
+		}
+		task(worker);
+		// Drop what the task holds before it counts as finished
+		task = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			active--;
+		}
+		idleCondition.notify_all();
+	}
+}
+
+// Start the workers
+ThreadPool::ThreadPool(unsigned int threadCount) {
+	if (threadCount == 0) {
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (unsigned int i = 0; i < threadCount; i++) {
+		workers.emplace_back(&ThreadPool::work, this, i);
+	}
+}
+
+// Finish the queued tasks and join the workers
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueCondition.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+// Number of workers
+unsigned int ThreadPool::size() const {
+	return (unsigned int)workers.size();
+}
+
+// Queue a task
+void ThreadPool::enqueue(std::function<void(unsigned int)> task) {
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		tasks.push(std::move(task));
+	}
+	queueCondition.notify_one();
+}
+
+// Wait until the queue is empty and no task is running
+void ThreadPool::wait() {
+	std::unique_lock<std::mutex> lock(queueMutex);
+	idleCondition.wait(lock, [this] { return tasks.empty() && active == 0; });
+}
+
+// Run task(index, worker) for every index in [0, count) and wait for all of them
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t, unsigned int)>& task) {
+	if (count == 0) {
+		return;
+	}
+	// Workers pull the next index until there are none left, so uneven tiles balance out
+	std::atomic<size_t> next(0);
+	std::mutex doneMutex;
+	std::condition_variable doneCondition;
+	unsigned int running = std::min((unsigned int)count, size());
+	unsigned int remaining = running;
+	for (unsigned int i = 0; i < running; i++) {
+		enqueue([&](unsigned int worker) {
+			for (size_t index = next++; index < count; index = next++) {
+				task(index, worker);
+			}
+			std::lock_guard<std::mutex> lock(doneMutex);
+			if (--remaining == 0) {
+				doneCondition.notify_one();
+			}
+		});
+	}
+	std::unique_lock<std::mutex> lock(doneMutex);
+	doneCondition.wait(lock, [&] { return remaining == 0; });
+}
@@ -0,0 +1,43 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// STD
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void(unsigned int)>> tasks;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopping = false;
+	// Tasks taken from the queue and not yet finished, and the condition wait() sleeps on
+	unsigned int active = 0;
+	std::condition_variable idleCondition;
+
+	// Take tasks from the queue until the pool is destroyed
+	void work(unsigned int worker);
+
+public:
+	// Start the workers, one per hardware thread if threadCount is 0
+	ThreadPool(unsigned int threadCount = 0);
+	// Finish the queued tasks and join the workers
+	~ThreadPool();
+	// Number of workers
+	unsigned int size() const;
+	// Queue a task, it is passed the index of the worker running it
+	void enqueue(std::function<void(unsigned int)> task);
+	// Wait until the queue is empty and no task is running
+	// Must not be called from inside a task
+	void wait();
+	// Run task(index, worker) for every index in [0, count) across the workers and wait for all of them
+	// Must not be called from inside a task
+	void parallelFor(size_t count, const std::function<void(size_t, unsigned int)>& task);
+};
+
+#endif
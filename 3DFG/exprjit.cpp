@@ -0,0 +1,387 @@
+#include "exprjit.hpp"
+#include "exprutil.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace ExprUtil {
+
+	// Whether native code can be generated and run on this platform
+	bool NativeCode::supported() {
+#if defined(__x86_64__) || defined(_M_X64)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Copy the code into executable memory
+	// The pages are written first and only then made executable, never both at once
+	NativeCode::NativeCode(const std::vector<unsigned char>& code) {
+		if (!supported() || code.empty()) {
+			return;
+		}
+#if defined(_WIN32)
+		memory = VirtualAlloc(nullptr, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (memory == nullptr) {
+			return;
+		}
+		std::memcpy(memory, code.data(), code.size());
+		DWORD oldProtect;
+		if (!VirtualProtect(memory, code.size(), PAGE_EXECUTE_READ, &oldProtect)) {
+			VirtualFree(memory, 0, MEM_RELEASE);
+			memory = nullptr;
+			return;
+		}
+#else
+		memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED) {
+			memory = nullptr;
+			return;
+		}
+		std::memcpy(memory, code.data(), code.size());
+		if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+			munmap(memory, code.size());
+			memory = nullptr;
+			return;
+		}
+#endif
+		size = code.size();
+	}
+
+	// Release the memory
+	NativeCode::~NativeCode() {
+		if (memory == nullptr) {
+			return;
+		}
+#if defined(_WIN32)
+		VirtualFree(memory, 0, MEM_RELEASE);
+#else
+		munmap(memory, size);
+#endif
+	}
+
+	// Whether the code is ready to run
+	bool NativeCode::valid() const {
+		return memory != nullptr;
+	}
+
+	// Get the kernel starting at an offset into the code
+	NativeCode::Kernel NativeCode::kernel(size_t offset) const {
+		return reinterpret_cast<Kernel>(static_cast<unsigned char*>(memory) + offset);
+	}
+
+	// x86-64 encoding helpers
+	// Kernels keep the registers in rbx, the slot table in r12, the output table in r13, the lane offset in r14 and the end in r15
+	namespace {
+		typedef std::vector<unsigned char> Bytes;
+
+		enum Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7, R8 = 8, R9 = 9, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+		void put8(Bytes& code, unsigned int value) {
+			code.push_back((unsigned char)value);
+		}
+		void put32(Bytes& code, uint32_t value) {
+			for (int i = 0; i < 4; i++) {
+				put8(code, (value >> (8 * i)) & 0xFF);
+			}
+		}
+		void put64(Bytes& code, uint64_t value) {
+			for (int i = 0; i < 8; i++) {
+				put8(code, (unsigned int)((value >> (8 * i)) & 0xFF));
+			}
+		}
+		// Patch a rel32 jump at position to land on target
+		void patch32(Bytes& code, size_t position, size_t target) {
+			uint32_t rel = (uint32_t)(int32_t)((int64_t)target - (int64_t)(position + 4));
+			for (int i = 0; i < 4; i++) {
+				code[position + i] = (rel >> (8 * i)) & 0xFF;
+			}
+		}
+		// mov dst, src
+		void movRR(Bytes& code, int dst, int src) {
+			put8(code, 0x48 | ((src >> 3) << 2) | (dst >> 3));
+			put8(code, 0x89);
+			put8(code, 0xC0 | ((src & 7) << 3) | (dst & 7));
+		}
+		// mov rax, [r12 + disp]
+		void loadSlotTable(Bytes& code, int32_t disp) {
+			put8(code, 0x49); put8(code, 0x8B); put8(code, 0x84); put8(code, 0x24);
+			put32(code, (uint32_t)disp);
+		}
+		// SSE op xmm, [rbx + disp]
+		void sseRbx(Bytes& code, unsigned int prefix, unsigned int opcode, int xmm, int32_t disp) {
+			if (prefix != 0) {
+				put8(code, prefix);
+			}
+			put8(code, 0x0F); put8(code, opcode); put8(code, 0x80 | (xmm << 3) | RBX);
+			put32(code, (uint32_t)disp);
+		}
+		// SSE op xmm, [rax + r14]
+		void sseRaxR14(Bytes& code, unsigned int prefix, unsigned int opcode, int xmm) {
+			if (prefix != 0) {
+				put8(code, prefix);
+			}
+			put8(code, 0x42); put8(code, 0x0F); put8(code, opcode); put8(code, 0x04 | (xmm << 3)); put8(code, 0x30);
+		}
+		// SSE op dst, src
+		void sseRR(Bytes& code, unsigned int prefix, unsigned int opcode, int dst, int src) {
+			if (prefix != 0) {
+				put8(code, prefix);
+			}
+			put8(code, 0x0F); put8(code, opcode); put8(code, 0xC0 | (dst << 3) | src);
+		}
+		// Fill xmm with copies of a float or double given by its bits
+		void broadcastBits(Bytes& code, int xmm, uint64_t bits, bool isDouble) {
+			if (isDouble) {
+				// mov rax, imm64; movq xmm, rax; punpcklqdq xmm, xmm
+				put8(code, 0x48); put8(code, 0xB8); put64(code, bits);
+				put8(code, 0x66); put8(code, 0x48); put8(code, 0x0F); put8(code, 0x6E); put8(code, 0xC0 | (xmm << 3));
+				sseRR(code, 0x66, 0x6C, xmm, xmm);
+			} else {
+				// mov eax, imm32; movd xmm, eax; pshufd xmm, xmm, 0
+				put8(code, 0xB8); put32(code, (uint32_t)bits);
+				put8(code, 0x66); put8(code, 0x0F); put8(code, 0x6E); put8(code, 0xC0 | (xmm << 3));
+				sseRR(code, 0x66, 0x70, xmm, xmm);
+				put8(code, 0x00);
+			}
+		}
+		// lea dst, [rbx + disp]
+		void leaRbx(Bytes& code, int dst, int32_t disp) {
+			put8(code, 0x48 | ((dst >> 3) << 2));
+			put8(code, 0x8D); put8(code, 0x80 | ((dst & 7) << 3) | RBX);
+			put32(code, (uint32_t)disp);
+		}
+		// mov dst, imm32
+		void movImm32(Bytes& code, int dst, uint32_t value) {
+			if (dst >= 8) {
+				put8(code, 0x41);
+			}
+			put8(code, 0xB8 | (dst & 7));
+			put32(code, value);
+		}
+		// mov rax, imm64; call rax
+		void callAbsolute(Bytes& code, const void* function) {
+			put8(code, 0x48); put8(code, 0xB8); put64(code, (uint64_t)(uintptr_t)function);
+			put8(code, 0xFF); put8(code, 0xD0);
+		}
+	}
+
+	// Raise a to the power of b, callable from native code
+	template <typename T>
+	T Expression<T>::power(T a, T b) {
+		return std::pow(a, b);
+	}
+
+	// Append a kernel running the program one lane or one SSE register of lanes at a time
+	// Every register of the program gets 16 bytes at rbx. The loop runs the instructions in order through xmm0 and xmm1,
+	// so each lane sees exactly the operations the interpreter performs. Literals and slots without a column
+	// are written once before the loop
+	template <typename T>
+	void Expression<T>::emitKernel(std::vector<unsigned char>& code, const Program& program, bool packed) {
+		const bool isDouble = sizeof(T) == 8;
+		const int lanes = packed ? 16 / (int)sizeof(T) : 1;
+		const unsigned int step = packed ? 16 : (unsigned int)sizeof(T);
+		// Prefixes of moves and arithmetic
+		const unsigned int move = packed ? 0x00 : (isDouble ? 0xF2 : 0xF3);
+		const unsigned int arith = packed ? (isDouble ? 0x66 : 0x00) : (isDouble ? 0xF2 : 0xF3);
+		const unsigned int scalarMove = isDouble ? 0xF2 : 0xF3;
+		auto reg = [](int r) { return (int32_t)r * 16; };
+		// Prologue, keeping the stack aligned for calls and leaving shadow space for Windows
+		put8(code, 0x53);
+		put8(code, 0x41); put8(code, 0x54);
+		put8(code, 0x41); put8(code, 0x55);
+		put8(code, 0x41); put8(code, 0x56);
+		put8(code, 0x41); put8(code, 0x57);
+		put8(code, 0x48); put8(code, 0x83); put8(code, 0xEC); put8(code, 0x20);
+#if defined(_WIN32)
+		movRR(code, RBX, RCX);
+		movRR(code, R12, RDX);
+		movRR(code, R13, R8);
+		movRR(code, R15, R9);
+#else
+		movRR(code, RBX, RDI);
+		movRR(code, R12, RSI);
+		movRR(code, R13, RDX);
+		movRR(code, R15, RCX);
+#endif
+		// Values that are the same for every lane
+		const std::vector<Instruction>& instructions = program.instructions;
+		for (size_t i = 0; i < instructions.size(); i++) {
+			const Instruction& ins = instructions[i];
+			if (ins.op == Op::Literal) {
+				uint64_t bits = 0;
+				std::memcpy(&bits, &ins.value, sizeof(T));
+				broadcastBits(code, 0, bits, isDouble);
+				sseRbx(code, 0x00, 0x11, 0, reg((int)i));
+			} else if (ins.op == Op::Variable) {
+				// Only if the slot has no column, test rax, rax; jnz
+				loadSlotTable(code, ins.a * 16);
+				put8(code, 0x48); put8(code, 0x85); put8(code, 0xC0);
+				put8(code, 0x75);
+				size_t jump = code.size();
+				put8(code, 0x00);
+				// mov rax, [r12 + disp + 8]; load the value and copy it to every lane
+				loadSlotTable(code, ins.a * 16 + 8);
+				put8(code, scalarMove); put8(code, 0x0F); put8(code, 0x10); put8(code, 0x00);
+				if (isDouble) {
+					sseRR(code, 0x66, 0x14, 0, 0);
+				} else {
+					sseRR(code, 0x00, 0xC6, 0, 0);
+					put8(code, 0x00);
+				}
+				sseRbx(code, 0x00, 0x11, 0, reg((int)i));
+				code[jump] = (unsigned char)(code.size() - jump - 1);
+			}
+		}
+		// xor r14, r14; test r15, r15; jz end
+		put8(code, 0x4D); put8(code, 0x31); put8(code, 0xF6);
+		put8(code, 0x4D); put8(code, 0x85); put8(code, 0xFF);
+		put8(code, 0x0F); put8(code, 0x84);
+		size_t skipLoop = code.size();
+		put32(code, 0);
+		size_t loop = code.size();
+		for (size_t i = 0; i < instructions.size(); i++) {
+			const Instruction& ins = instructions[i];
+			int32_t r = reg((int)i);
+			int32_t a = reg(ins.a);
+			int32_t b = reg(ins.b);
+			switch (ins.op) {
+			case Op::Literal:
+				break;
+			case Op::Variable: {
+				// Only if the slot has a column, test rax, rax; jz
+				loadSlotTable(code, ins.a * 16);
+				put8(code, 0x48); put8(code, 0x85); put8(code, 0xC0);
+				put8(code, 0x74);
+				size_t jump = code.size();
+				put8(code, 0x00);
+				sseRaxR14(code, move, 0x10, 0);
+				sseRbx(code, move, 0x11, 0, r);
+				code[jump] = (unsigned char)(code.size() - jump - 1);
+				break;
+			}
+			case Op::Negate:
+				// Flip the sign bit
+				sseRbx(code, move, 0x10, 0, a);
+				broadcastBits(code, 1, isDouble ? 0x8000000000000000ull : 0x80000000ull, isDouble);
+				sseRR(code, 0x00, 0x57, 0, 1);
+				sseRbx(code, move, 0x11, 0, r);
+				break;
+			case Op::Add:
+			case Op::Subtract:
+			case Op::Multiply:
+			case Op::Divide: {
+				unsigned int opcode = ins.op == Op::Add ? 0x58 : ins.op == Op::Subtract ? 0x5C : ins.op == Op::Multiply ? 0x59 : 0x5E;
+				sseRbx(code, move, 0x10, 0, a);
+				sseRbx(code, move, 0x10, 1, b);
+				sseRR(code, arith, opcode, 0, 1);
+				sseRbx(code, move, 0x11, 0, r);
+				break;
+			}
+			case Op::Call:
+				// Functions with a batch form take a whole SSE register of lanes in one call
+				if (packed && ins.batch != nullptr) {
+#if defined(_WIN32)
+					leaRbx(code, RCX, a);
+					leaRbx(code, RDX, r);
+					movImm32(code, R8, (uint32_t)lanes);
+#else
+					leaRbx(code, RDI, a);
+					leaRbx(code, RSI, r);
+					movImm32(code, RDX, (uint32_t)lanes);
+#endif
+					callAbsolute(code, (const void*)ins.batch);
+					break;
+				}
+				// Fall through
+			case Op::Pow:
+			case Op::Min:
+			case Op::Max:
+			case Op::Atan2:
+			case Op::Less: {
+				// Other functions are called once per lane, those of two values through the same helpers as the interpreter
+				// so NaN and signed zeros come out the same
+				T(*binary)(T, T) = ins.op == Op::Pow ? &Expression<T>::power : ins.op == Op::Min ? &Expression<T>::minimum
+					: ins.op == Op::Max ? &Expression<T>::maximum : ins.op == Op::Atan2 ? &Expression<T>::arctangent : &Expression<T>::less;
+				for (int lane = 0; lane < lanes; lane++) {
+					int32_t offset = lane * (int32_t)sizeof(T);
+					sseRbx(code, scalarMove, 0x10, 0, a + offset);
+					if (ins.op != Op::Call) {
+						sseRbx(code, scalarMove, 0x10, 1, b + offset);
+						callAbsolute(code, (const void*)binary);
+					} else {
+						callAbsolute(code, (const void*)ins.fn);
+					}
+					sseRbx(code, scalarMove, 0x11, 0, r + offset);
+				}
+				break;
+			}
+			default:
+				break;
+			}
+		}
+		// Store the result and the outputs to their columns, mov rax, [r13 + disp]
+		for (size_t k = 0; k <= program.outputs.size(); k++) {
+			sseRbx(code, move, 0x10, 0, reg(k == 0 ? program.result : program.outputs[k - 1]));
+			put8(code, 0x49); put8(code, 0x8B); put8(code, 0x85);
+			put32(code, (uint32_t)(k * 8));
+			sseRaxR14(code, move, 0x11, 0);
+		}
+		// add r14, step; cmp r14, r15; jb loop
+		put8(code, 0x49); put8(code, 0x81); put8(code, 0xC6); put32(code, step);
+		put8(code, 0x4D); put8(code, 0x39); put8(code, 0xFE);
+		put8(code, 0x0F); put8(code, 0x82);
+		put32(code, 0);
+		patch32(code, code.size() - 4, loop);
+		patch32(code, skipLoop, code.size());
+		// Epilogue
+		put8(code, 0x48); put8(code, 0x83); put8(code, 0xC4); put8(code, 0x20);
+		put8(code, 0x41); put8(code, 0x5F);
+		put8(code, 0x41); put8(code, 0x5E);
+		put8(code, 0x41); put8(code, 0x5D);
+		put8(code, 0x41); put8(code, 0x5C);
+		put8(code, 0x5B);
+		put8(code, 0xC3);
+	}
+
+	// Generate native code for a program
+	// If anything is unavailable the program keeps running on the interpreter, as do programs with loops
+	template <typename T>
+	void Expression<T>::compileNative(Program& program) const {
+		if (!jit || !NativeCode::supported() || program.instructions.empty()) {
+			return;
+		}
+		if (std::any_of(program.instructions.begin(), program.instructions.end(), [](const Instruction& ins) { return ins.op == Op::Loop; })) {
+			return;
+		}
+		std::vector<unsigned char> code;
+		size_t scalarEntry = code.size();
+		emitKernel(code, program, false);
+		size_t batchEntry = code.size();
+		emitKernel(code, program, true);
+		std::shared_ptr<NativeCode> native = std::make_shared<NativeCode>(code);
+		if (!native->valid()) {
+			return;
+		}
+		program.native = native;
+		program.scalarKernel = native->kernel(scalarEntry);
+		program.batchKernel = native->kernel(batchEntry);
+	}
+
+	// Instantiation
+	template float Expression<float>::power(float, float);
+	template double Expression<double>::power(double, double);
+	template void Expression<float>::emitKernel(std::vector<unsigned char>&, const Program&, bool);
+	template void Expression<double>::emitKernel(std::vector<unsigned char>&, const Program&, bool);
+	template void Expression<float>::compileNative(Program&) const;
+	template void Expression<double>::compileNative(Program&) const;
+}
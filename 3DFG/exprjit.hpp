@@ -0,0 +1,35 @@
+#ifndef EXPRJIT_H
+#define EXPRJIT_H
+
+#include <cstddef>
+#include <vector>
+
+namespace ExprUtil {
+
+	// Executable memory holding native code generated for an expression
+	class NativeCode {
+	private:
+		void* memory = nullptr;
+		size_t size = 0;
+
+	public:
+		// Signature of a generated kernel
+		// Runs the program for each lane in [0, bytes) of the slot columns, writing the result to the column out[0]
+		// and each further output of the program to the columns after it
+		typedef void(*Kernel)(void* registers, const void* const* slots, void* const* out, size_t bytes);
+		// Whether native code can be generated and run on this platform
+		static bool supported();
+		// Copy the code into executable memory, valid() is false if that failed
+		NativeCode(const std::vector<unsigned char>& code);
+		// Release the memory
+		~NativeCode();
+		NativeCode(const NativeCode&) = delete;
+		NativeCode& operator=(const NativeCode&) = delete;
+		// Whether the code is ready to run
+		bool valid() const;
+		// Get the kernel starting at an offset into the code
+		Kernel kernel(size_t offset) const;
+	};
+}
+
+#endif
@@ -0,0 +1,617 @@
+#include "exprmath.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EXPRMATH_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace ExprUtil {
+
+	// Every function is a core that runs the same operations on any value in its range, written once for a single
+	// value and for a pack of SSE lanes so both give the same bits, and a fallback to the standard library for
+	// everything else (huge arguments, infinities, not a number, values outside the domain). The batch form runs
+	// the core over whole packs first and fixes the few values out of range afterwards
+	namespace {
+		// Integer with the bits of a float or double
+		template <typename T>
+		struct Bits;
+		template <>
+		struct Bits<float> {
+			typedef uint32_t Type;
+			static const int mantissa = 23;
+			static const int bias = 127;
+		};
+		template <>
+		struct Bits<double> {
+			typedef uint64_t Type;
+			static const int mantissa = 52;
+			static const int bias = 1023;
+		};
+
+		template <typename T>
+		typename Bits<T>::Type toBits(T x) {
+			typename Bits<T>::Type bits;
+			std::memcpy(&bits, &x, sizeof(T));
+			return bits;
+		}
+		template <typename T>
+		T fromBits(typename Bits<T>::Type bits) {
+			T x;
+			std::memcpy(&x, &bits, sizeof(T));
+			return x;
+		}
+
+		// Type of the lanes of a pack and how many there are, a single value is a pack of one
+		template <typename P>
+		struct Lane {
+			typedef P Type;
+			static const size_t width = 1;
+		};
+
+		// Operations on a single value, masks are bools
+		template <typename T>
+		T select(bool mask, T a, T b) {
+			return mask ? a : b;
+		}
+		inline bool both(bool a, bool b) {
+			return a && b;
+		}
+		template <typename T>
+		bool lessEqual(T a, T b) {
+			return a <= b;
+		}
+		template <typename T>
+		bool greater(T a, T b) {
+			return a > b;
+		}
+		inline float absolute(float x) {
+			return std::abs(x);
+		}
+		inline double absolute(double x) {
+			return std::abs(x);
+		}
+		inline float root(float x) {
+			return std::sqrt(x);
+		}
+		inline double root(double x) {
+			return std::sqrt(x);
+		}
+		// Whether bit of the bits of x is set, for a bit in the low 32
+		template <typename T>
+		bool bitSet(T x, unsigned int bit) {
+			return (toBits(x) & bit) != 0;
+		}
+		// 2 ^ k where shifted = k + shift from nearest()
+		template <typename T>
+		T pow2(T shifted, T shift) {
+			return fromBits<T>((toBits(shifted) - toBits(shift) + Bits<T>::bias) << Bits<T>::mantissa);
+		}
+		// Biased exponent of a positive x
+		template <typename T>
+		T exponent(T x) {
+			return T(toBits(x) >> Bits<T>::mantissa);
+		}
+		// Mantissa of x in [1, 2)
+		template <typename T>
+		T mantissa(T x) {
+			const typename Bits<T>::Type mask = (typename Bits<T>::Type(1) << Bits<T>::mantissa) - 1;
+			return fromBits<T>((toBits(x) & mask) | toBits(T(1)));
+		}
+		// x with the low 32 bits cleared
+		inline double truncate(double x) {
+			return fromBits<double>(toBits(x) & 0xFFFFFFFF00000000ull);
+		}
+
+#if defined(EXPRMATH_SSE2)
+		// Four floats
+		struct F4 {
+			__m128 v;
+			F4() : v(_mm_setzero_ps()) {}
+			F4(__m128 v) : v(v) {}
+			F4(float x) : v(_mm_set1_ps(x)) {}
+		};
+		template <>
+		struct Lane<F4> {
+			typedef float Type;
+			static const size_t width = 4;
+		};
+		inline F4 operator+(F4 a, F4 b) { return _mm_add_ps(a.v, b.v); }
+		inline F4 operator-(F4 a, F4 b) { return _mm_sub_ps(a.v, b.v); }
+		inline F4 operator*(F4 a, F4 b) { return _mm_mul_ps(a.v, b.v); }
+		inline F4 operator/(F4 a, F4 b) { return _mm_div_ps(a.v, b.v); }
+		inline F4 operator-(F4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+		inline F4 select(F4 mask, F4 a, F4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+		inline F4 both(F4 a, F4 b) { return _mm_and_ps(a.v, b.v); }
+		inline F4 lessEqual(F4 a, F4 b) { return _mm_cmple_ps(a.v, b.v); }
+		inline F4 greater(F4 a, F4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+		inline F4 absolute(F4 x) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), x.v); }
+		inline F4 root(F4 x) { return _mm_sqrt_ps(x.v); }
+		inline F4 bitSet(F4 x, unsigned int bit) {
+			__m128i b = _mm_set1_epi32((int)bit);
+			return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_castps_si128(x.v), b), b));
+		}
+		inline F4 pow2(F4 shifted, F4 shift) {
+			__m128i k = _mm_sub_epi32(_mm_castps_si128(shifted.v), _mm_castps_si128(shift.v));
+			return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(k, _mm_set1_epi32(Bits<float>::bias)), Bits<float>::mantissa));
+		}
+		inline F4 exponent(F4 x) {
+			return _mm_cvtepi32_ps(_mm_srli_epi32(_mm_castps_si128(x.v), Bits<float>::mantissa));
+		}
+		inline F4 mantissa(F4 x) {
+			__m128i bits = _mm_and_si128(_mm_castps_si128(x.v), _mm_set1_epi32((1 << Bits<float>::mantissa) - 1));
+			return _mm_or_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.0f));
+		}
+		inline F4 load(const float* p) { return _mm_loadu_ps(p); }
+		inline void store(float* p, F4 x) { _mm_storeu_ps(p, x.v); }
+
+		// Two doubles
+		struct D2 {
+			__m128d v;
+			D2() : v(_mm_setzero_pd()) {}
+			D2(__m128d v) : v(v) {}
+			D2(double x) : v(_mm_set1_pd(x)) {}
+		};
+		template <>
+		struct Lane<D2> {
+			typedef double Type;
+			static const size_t width = 2;
+		};
+		inline D2 operator+(D2 a, D2 b) { return _mm_add_pd(a.v, b.v); }
+		inline D2 operator-(D2 a, D2 b) { return _mm_sub_pd(a.v, b.v); }
+		inline D2 operator*(D2 a, D2 b) { return _mm_mul_pd(a.v, b.v); }
+		inline D2 operator/(D2 a, D2 b) { return _mm_div_pd(a.v, b.v); }
+		inline D2 operator-(D2 a) { return _mm_xor_pd(a.v, _mm_set1_pd(-0.0)); }
+		inline D2 select(D2 mask, D2 a, D2 b) { return _mm_or_pd(_mm_and_pd(mask.v, a.v), _mm_andnot_pd(mask.v, b.v)); }
+		inline D2 both(D2 a, D2 b) { return _mm_and_pd(a.v, b.v); }
+		inline D2 lessEqual(D2 a, D2 b) { return _mm_cmple_pd(a.v, b.v); }
+		inline D2 greater(D2 a, D2 b) { return _mm_cmpgt_pd(a.v, b.v); }
+		inline D2 absolute(D2 x) { return _mm_andnot_pd(_mm_set1_pd(-0.0), x.v); }
+		inline D2 root(D2 x) { return _mm_sqrt_pd(x.v); }
+		inline D2 bitSet(D2 x, unsigned int bit) {
+			// Compare the low half of each lane and spread the result over the lane
+			__m128i b = _mm_set1_epi32((int)bit);
+			__m128i set = _mm_cmpeq_epi32(_mm_and_si128(_mm_castpd_si128(x.v), b), b);
+			return _mm_castsi128_pd(_mm_shuffle_epi32(set, _MM_SHUFFLE(2, 2, 0, 0)));
+		}
+		inline D2 pow2(D2 shifted, D2 shift) {
+			__m128i k = _mm_sub_epi64(_mm_castpd_si128(shifted.v), _mm_castpd_si128(shift.v));
+			return _mm_castsi128_pd(_mm_slli_epi64(_mm_add_epi64(k, _mm_set_epi32(0, Bits<double>::bias, 0, Bits<double>::bias)), Bits<double>::mantissa));
+		}
+		inline D2 exponent(D2 x) {
+			// The exponent field below the bits of 2^52 gives 2^52 + e, exactly
+			__m128i e = _mm_srli_epi64(_mm_castpd_si128(x.v), Bits<double>::mantissa);
+			__m128d two52 = _mm_set1_pd(4503599627370496.0);
+			return _mm_sub_pd(_mm_or_pd(_mm_castsi128_pd(e), two52), two52);
+		}
+		inline D2 mantissa(D2 x) {
+			__m128i mask = _mm_set_epi32(0x000FFFFF, (int)0xFFFFFFFF, 0x000FFFFF, (int)0xFFFFFFFF);
+			return _mm_or_pd(_mm_castsi128_pd(_mm_and_si128(_mm_castpd_si128(x.v), mask)), _mm_set1_pd(1.0));
+		}
+		inline D2 truncate(D2 x) {
+			return _mm_and_pd(x.v, _mm_castsi128_pd(_mm_set_epi32((int)0xFFFFFFFF, 0, (int)0xFFFFFFFF, 0)));
+		}
+		inline D2 load(const double* p) { return _mm_loadu_pd(p); }
+		inline void store(double* p, D2 x) { _mm_storeu_pd(p, x.v); }
+
+		// Widest pack of a type
+		template <typename T>
+		struct Wide;
+		template <>
+		struct Wide<float> {
+			typedef F4 Type;
+		};
+		template <>
+		struct Wide<double> {
+			typedef D2 Type;
+		};
+#endif
+
+		// Round to the nearest whole number, for |x| well below 2 ^ mantissa
+		// shifted keeps the sum whose low bits hold the whole number, see bitSet() and pow2()
+		template <typename P>
+		P nearest(P x, P& shifted) {
+			typedef typename Lane<P>::Type T;
+			const P shift = P(T(1.5) * T(typename Bits<T>::Type(1) << Bits<T>::mantissa));
+			shifted = x + shift;
+			return shifted - shift;
+		}
+		template <typename P>
+		P shiftOf() {
+			typedef typename Lane<P>::Type T;
+			return P(T(1.5) * T(typename Bits<T>::Type(1) << Bits<T>::mantissa));
+		}
+
+		// Standard library, a single value at a time
+		template <typename T, T(*F)(T)>
+		struct Standard {
+			static const bool wide = false;
+			static const bool checked = false;
+			static constexpr T safe = 0;
+			static bool inRange(T) { return true; }
+			static T core(T x) { return F(x); }
+			static T fallback(T x) { return F(x); }
+		};
+		template <typename T> T sinStd(T x) { return std::sin(x); }
+		template <typename T> T cosStd(T x) { return std::cos(x); }
+		template <typename T> T tanStd(T x) { return std::tan(x); }
+		template <typename T> T expStd(T x) { return std::exp(x); }
+		template <typename T> T logStd(T x) { return std::log(x); }
+
+		// Exact everywhere and single instructions in a pack
+		struct Abs {
+			static const bool wide = true;
+			static const bool checked = false;
+			template <typename P> static P core(P x) { return absolute(x); }
+		};
+		struct Sqrt {
+			static const bool wide = true;
+			static const bool checked = false;
+			template <typename P> static P core(P x) { return root(x); }
+		};
+
+		// Faithful kernels in double after fdlibm, within an ulp on their range
+		// Quarter turn in three parts, the first two have few enough bits that j times them is exact for |j| < 2^20
+		const double pio2_1 = 1.57079632673412561417e+00;
+		const double pio2_2 = 6.07710050630396597660e-11;
+		const double pio2_3 = 2.02226624879595063154e-21;
+		const double ln2Hi = 6.93147180369123816490e-01;
+		const double ln2Lo = 1.90821492927058770002e-10;
+
+		// sin and cos on [-pi/4, pi/4]
+		template <typename P>
+		P kernelSin(P x) {
+			P z = x * x;
+			P r = P(8.33333333332248946124e-03) + z * (P(-1.98412698298579493134e-04) + z * (P(2.75573137070700676789e-06)
+				+ z * (P(-2.50507602534068634195e-08) + z * P(1.58969099521155010221e-10))));
+			return x + z * x * (P(-1.66666666666666324348e-01) + z * r);
+		}
+		template <typename P>
+		P kernelCos(P x) {
+			P z = x * x;
+			P r = z * (P(4.16666666666666019037e-02) + z * (P(-1.38888888888741095749e-03) + z * (P(2.48015872894767294178e-05)
+				+ z * (P(-2.75573143513906633035e-07) + z * (P(2.08757232129817482790e-09) + z * P(-1.13596475577881948265e-11))))));
+			// Past 0.3 take about a quarter of x off 1 first so 1 - x^2 / 2 keeps its precision
+			P ax = absolute(x);
+			P qx = select(lessEqual(ax, P(0.3)), P(0.0), select(greater(ax, P(0.78125)), P(0.28125), truncate(ax) * P(0.25)));
+			return (P(1.0) - qx) - ((P(0.5) * z - qx) - z * r);
+		}
+		// Reduce x to r in [-pi/4, pi/4], shifted holds the quadrant in its low bits
+		template <typename P>
+		P reduce(P x, P& shifted) {
+			P j = nearest(x * P(6.36619772367581382433e-01), shifted);
+			return ((x - j * P(pio2_1)) - j * P(pio2_2)) - j * P(pio2_3);
+		}
+
+		struct FaithfulSin {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr double safe = 0;
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(1e5)); }
+			template <typename P> static P core(P x) {
+				P q;
+				P r = reduce(x, q);
+				P v = select(bitSet(q, 1), kernelCos(r), kernelSin(r));
+				return select(bitSet(q, 2), -v, v);
+			}
+			static double fallback(double x) { return std::sin(x); }
+		};
+		struct FaithfulCos {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr double safe = 0;
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(1e5)); }
+			template <typename P> static P core(P x) {
+				P q;
+				P r = reduce(x, q);
+				P v = select(bitSet(q, 1), kernelSin(r), kernelCos(r));
+				// Negative in the second and third quadrant
+				return select(bitSet(q + P(1.0), 2), -v, v);
+			}
+			static double fallback(double x) { return std::cos(x); }
+		};
+		struct FaithfulTan {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr double safe = 0;
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(1e5)); }
+			template <typename P> static P core(P x) {
+				P q;
+				P r = reduce(x, q);
+				P s = kernelSin(r);
+				P c = kernelCos(r);
+				return select(bitSet(q, 1), -c / s, s / c);
+			}
+			static double fallback(double x) { return std::tan(x); }
+		};
+		struct FaithfulExp {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr double safe = 0;
+			// Keeps 2^k normal
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(708.0)); }
+			template <typename P> static P core(P x) {
+				P shifted;
+				P k = nearest(x * P(1.44269504088896338700e+00), shifted);
+				P hi = x - k * P(ln2Hi);
+				P lo = k * P(ln2Lo);
+				P r = hi - lo;
+				P t = r * r;
+				P c = r - t * (P(1.66666666666666019037e-01) + t * (P(-2.77777777770155933842e-03) + t * (P(6.61375632143793436117e-05)
+					+ t * (P(-1.65339022054652515390e-06) + t * P(4.13813679705723846039e-08)))));
+				P y = P(1.0) - ((lo - (r * c) / (P(2.0) - c)) - hi);
+				return y * pow2(shifted, shiftOf<P>());
+			}
+			static double fallback(double x) { return std::exp(x); }
+		};
+		struct FaithfulLog {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr double safe = 1;
+			// Positive and normal
+			template <typename P> static auto inRange(P x) {
+				return both(lessEqual(P(std::numeric_limits<double>::min()), x), lessEqual(x, P(std::numeric_limits<double>::max())));
+			}
+			template <typename P> static P core(P x) {
+				// x = 2^k m with sqrt(2) / 2 < m <= sqrt(2)
+				P m = mantissa(x);
+				auto high = greater(m, P(1.41421356237309504880));
+				P k = exponent(x) - P(1023.0) + select(high, P(1.0), P(0.0));
+				P f = select(high, m * P(0.5), m) - P(1.0);
+				P s = f / (P(2.0) + f);
+				P z = s * s;
+				P w = z * z;
+				P t1 = w * (P(3.999999999940941908e-01) + w * (P(2.222219843214978396e-01) + w * P(1.531383769920937332e-01)));
+				P t2 = z * (P(6.666666666666735130e-01) + w * (P(2.857142874366239149e-01) + w * (P(1.818357216161805012e-01) + w * P(1.479819860511658591e-01))));
+				P hfsq = P(0.5) * f * f;
+				return k * P(ln2Hi) - ((hfsq - (s * (hfsq + t2 + t1) + k * P(ln2Lo))) - f);
+			}
+			static double fallback(double x) { return std::log(x); }
+		};
+
+		// Faithful functions for a float round the double result, which is within half an ulp and a bit
+		template <typename D>
+		struct FaithfulFloat {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr float safe = float(D::safe);
+			static bool inRange(float x) { return D::inRange((double)x); }
+			static float core(float x) { return (float)D::core((double)x); }
+			static float fallback(float x) { return (float)D::fallback((double)x); }
+#if defined(EXPRMATH_SSE2)
+			static F4 inRange(F4 x) {
+				D2 lo = D::inRange(D2(_mm_cvtps_pd(x.v)));
+				D2 hi = D::inRange(D2(_mm_cvtps_pd(_mm_movehl_ps(x.v, x.v))));
+				return _mm_shuffle_ps(_mm_castpd_ps(lo.v), _mm_castpd_ps(hi.v), _MM_SHUFFLE(2, 0, 2, 0));
+			}
+			static F4 core(F4 x) {
+				D2 lo = D::core(D2(_mm_cvtps_pd(x.v)));
+				D2 hi = D::core(D2(_mm_cvtps_pd(_mm_movehl_ps(x.v, x.v))));
+				return _mm_movelh_ps(_mm_cvtpd_ps(lo.v), _mm_cvtpd_ps(hi.v));
+			}
+#endif
+		};
+		template <typename T, typename D>
+		struct Faithful {
+			typedef D Type;
+		};
+		template <typename D>
+		struct Faithful<float, D> {
+			typedef FaithfulFloat<D> Type;
+		};
+
+		// Fast functions in T with short Taylor polynomials, a little under 1e-4 from the exact result
+		// Quarter turn in three parts, the first two have few enough bits that j times them is exact in a float
+		template <typename P>
+		P reduceFast(P x, P& shifted) {
+			typedef typename Lane<P>::Type T;
+			P j = nearest(x * P(T(6.36619772367581382433e-01)), shifted);
+			return ((x - j * P(T(1.5703125))) - j * P(T(4.837512969970703125e-4))) - j * P(T(7.54978995489188216e-8));
+		}
+		template <typename P>
+		P sinFast(P r) {
+			typedef typename Lane<P>::Type T;
+			P z = r * r;
+			return r + r * z * (P(T(-1.0 / 6)) + z * P(T(1.0 / 120)));
+		}
+		template <typename P>
+		P cosFast(P r) {
+			typedef typename Lane<P>::Type T;
+			P z = r * r;
+			return P(T(1)) + z * (P(T(-0.5)) + z * (P(T(1.0 / 24)) + z * P(T(-1.0 / 720))));
+		}
+
+		template <typename T>
+		struct FastSin {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr T safe = 0;
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(T(1e4))); }
+			template <typename P> static P core(P x) {
+				P q;
+				P r = reduceFast(x, q);
+				P v = select(bitSet(q, 1), cosFast(r), sinFast(r));
+				return select(bitSet(q, 2), -v, v);
+			}
+			static T fallback(T x) { return std::sin(x); }
+		};
+		template <typename T>
+		struct FastCos {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr T safe = 0;
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(T(1e4))); }
+			template <typename P> static P core(P x) {
+				P q;
+				P r = reduceFast(x, q);
+				P v = select(bitSet(q, 1), sinFast(r), cosFast(r));
+				return select(bitSet(q + P(T(1)), 2), -v, v);
+			}
+			static T fallback(T x) { return std::cos(x); }
+		};
+		template <typename T>
+		struct FastTan {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr T safe = 0;
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(T(1e4))); }
+			template <typename P> static P core(P x) {
+				P q;
+				P r = reduceFast(x, q);
+				P s = sinFast(r);
+				P c = cosFast(r);
+				return select(bitSet(q, 1), -c / s, s / c);
+			}
+			static T fallback(T x) { return std::tan(x); }
+		};
+		template <typename T>
+		struct FastExp {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr T safe = 0;
+			// Keeps 2^k normal
+			template <typename P> static auto inRange(P x) { return lessEqual(absolute(x), P(T(sizeof(T) == 4 ? 87 : 708))); }
+			template <typename P> static P core(P x) {
+				P shifted;
+				P k = nearest(x * P(T(1.44269504088896338700)), shifted);
+				P r = (x - k * P(T(0.693359375))) - k * P(T(-2.12194440e-4));
+				P p = P(T(1)) + r * (P(T(1)) + r * (P(T(0.5)) + r * (P(T(1.0 / 6)) + r * (P(T(1.0 / 24)) + r * P(T(1.0 / 120))))));
+				return p * pow2(shifted, shiftOf<P>());
+			}
+			static T fallback(T x) { return std::exp(x); }
+		};
+		template <typename T>
+		struct FastLog {
+			static const bool wide = true;
+			static const bool checked = true;
+			static constexpr T safe = 1;
+			// Positive and normal
+			template <typename P> static auto inRange(P x) {
+				return both(lessEqual(P(std::numeric_limits<T>::min()), x), lessEqual(x, P(std::numeric_limits<T>::max())));
+			}
+			template <typename P> static P core(P x) {
+				P m = mantissa(x);
+				auto high = greater(m, P(T(1.41421356237309504880)));
+				P k = exponent(x) - P(T(Bits<T>::bias)) + select(high, P(T(1)), P(T(0)));
+				P f = select(high, m * P(T(0.5)), m) - P(T(1));
+				P s = f / (P(T(2)) + f);
+				P z = s * s;
+				return k * P(T(0.693147180559945309417)) + P(T(2)) * s * (P(T(1)) + z * (P(T(1.0 / 3)) + z * P(T(1.0 / 5))));
+			}
+			static T fallback(T x) { return std::log(x); }
+		};
+
+		// Scalar and batch form of a function
+		template <typename T, typename F>
+		T scalarForm(T x) {
+			if constexpr (F::checked) {
+				if (!F::inRange(x)) {
+					return F::fallback(x);
+				}
+			}
+			return F::core(x);
+		}
+		template <typename T, typename F>
+		void batchForm(const T* in, T* out, size_t n) {
+			size_t i = 0;
+#if defined(EXPRMATH_SSE2)
+			if constexpr (F::wide) {
+				typedef typename Wide<T>::Type W;
+				for (; i + Lane<W>::width <= n; i += Lane<W>::width) {
+					W x = load(in + i);
+					if constexpr (F::checked) {
+						x = select(F::inRange(x), x, W(T(F::safe)));
+					}
+					store(out + i, F::core(x));
+				}
+			}
+#endif
+			for (; i < n; i++) {
+				T x = in[i];
+				if constexpr (F::checked) {
+					x = F::inRange(x) ? x : T(F::safe);
+				}
+				out[i] = F::core(x);
+			}
+			// Values out of range are rare, they go through the standard library
+			if constexpr (F::checked) {
+				for (i = 0; i < n; i++) {
+					if (!F::inRange(in[i])) {
+						out[i] = F::fallback(in[i]);
+					}
+				}
+			}
+		}
+		template <typename T, typename F>
+		MathFunction<T> form() {
+			MathFunction<T> function;
+			function.scalar = &scalarForm<T, F>;
+			function.batch = &batchForm<T, F>;
+			return function;
+		}
+		template <typename T, typename Exact, typename Faithful, typename Fast>
+		MathFunction<T> tier(Accuracy accuracy) {
+			switch (accuracy) {
+			case Accuracy::Faithful:
+				return form<T, Faithful>();
+			case Accuracy::Fast:
+				return form<T, Fast>();
+			default:
+				return form<T, Exact>();
+			}
+		}
+	}
+
+	// Get a built in function at an accuracy
+	// abs and sqrt are exact at every accuracy, they are single instructions anyway
+	template <typename T>
+	MathFunction<T> mathFunction(Function function, Accuracy accuracy) {
+		switch (function) {
+		case Function::Sin:
+			return tier<T, Standard<T, sinStd<T>>, typename Faithful<T, FaithfulSin>::Type, FastSin<T>>(accuracy);
+		case Function::Cos:
+			return tier<T, Standard<T, cosStd<T>>, typename Faithful<T, FaithfulCos>::Type, FastCos<T>>(accuracy);
+		case Function::Tan:
+			return tier<T, Standard<T, tanStd<T>>, typename Faithful<T, FaithfulTan>::Type, FastTan<T>>(accuracy);
+		case Function::Exp:
+			return tier<T, Standard<T, expStd<T>>, typename Faithful<T, FaithfulExp>::Type, FastExp<T>>(accuracy);
+		case Function::Log:
+			return tier<T, Standard<T, logStd<T>>, typename Faithful<T, FaithfulLog>::Type, FastLog<T>>(accuracy);
+		case Function::Abs:
+			return form<T, Abs>();
+		case Function::Sqrt:
+			return form<T, Sqrt>();
+		default:
+			return MathFunction<T>();
+		}
+	}
+
+	// Bound on the error of the functions at an accuracy beyond that of the standard library
+	template <typename T>
+	void mathError(Accuracy accuracy, T& relative, T& absolute) {
+		switch (accuracy) {
+		case Accuracy::Faithful:
+			relative = 4 * std::numeric_limits<T>::epsilon();
+			absolute = 0;
+			break;
+		case Accuracy::Fast:
+			relative = T(1e-4);
+			absolute = T(1e-4);
+			break;
+		default:
+			relative = 0;
+			absolute = 0;
+			break;
+		}
+	}
+
+	// Instantiation
+	template MathFunction<float> mathFunction<float>(Function, Accuracy);
+	template MathFunction<double> mathFunction<double>(Function, Accuracy);
+	template void mathError<float>(Accuracy, float&, float&);
+	template void mathError<double>(Accuracy, double&, double&);
+}
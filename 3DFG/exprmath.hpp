@@ -0,0 +1,50 @@
+#ifndef EXPRMATH_H
+#define EXPRMATH_H
+
+#include <cstddef>
+
+namespace ExprUtil {
+
+	// Accuracy of the functions an expression calls
+	enum class Accuracy {
+		// Standard library
+		Exact,
+		// Polynomials within about an ulp
+		Faithful,
+		// Polynomials within about 1e-4, plenty for anything that ends up on screen
+		Fast
+	};
+
+	// Functions built into every expression
+	enum class Function {
+		Sin,
+		Cos,
+		Tan,
+		Abs,
+		Exp,
+		Log,
+		Sqrt,
+		// Registered by the user, see Expression::define(), the math layer knows nothing about it
+		User
+	};
+
+	// A function at an accuracy, for a single value and for n values at once
+	// batch(in, out, n) gives out[i] == scalar(in[i]) bit for bit, in and out must not overlap
+	template <typename T>
+	struct MathFunction {
+		T(*scalar)(T) = nullptr;
+		void(*batch)(const T* in, T* out, size_t n) = nullptr;
+	};
+
+	// Get a built in function at an accuracy, both forms are null for Function::User
+	// e.g. MathFunction<float> sin = mathFunction<float>(Function::Sin, Accuracy::Fast); sin.batch(xs, ys, count);
+	template <typename T>
+	MathFunction<T> mathFunction(Function function, Accuracy accuracy);
+
+	// Bound on the error of the functions at an accuracy beyond that of the standard library
+	// A result r of the exact value v has |r - v| <= relative * |v| + absolute
+	template <typename T>
+	void mathError(Accuracy accuracy, T& relative, T& absolute);
+}
+
+#endif
@@ -1,320 +1,2543 @@
 #include "exprutil.hpp"
 
+#include <charconv>
+
 namespace ExprUtil {
 
+	// Functions and constants built into every expression, found through a perfect hash fixed at compile time
+	namespace {
+		// Functions of one argument call the math layer, the others compile to instructions of their own
+		enum class Kind {
+			Function,
+			Constant,
+			Sum,
+			Product,
+			Minimum,
+			Maximum,
+			Atan2
+		};
+		struct Builtin {
+			std::string_view name;
+			Kind kind;
+			Function function;
+			double value;
+		};
+		constexpr Builtin builtins[] = {
+			{ "sin", Kind::Function, Function::Sin, 0 },
+			{ "cos", Kind::Function, Function::Cos, 0 },
+			{ "tan", Kind::Function, Function::Tan, 0 },
+			{ "abs", Kind::Function, Function::Abs, 0 },
+			{ "exp", Kind::Function, Function::Exp, 0 },
+			{ "log", Kind::Function, Function::Log, 0 },
+			{ "sqrt", Kind::Function, Function::Sqrt, 0 },
+			{ "pi", Kind::Constant, Function::User, 3.14159265358979323846 },
+			{ "sum", Kind::Sum, Function::User, 0 },
+			{ "prod", Kind::Product, Function::User, 0 },
+			{ "min", Kind::Minimum, Function::User, 0 },
+			{ "max", Kind::Maximum, Function::User, 0 },
+			{ "atan2", Kind::Atan2, Function::User, 0 }
+		};
+		constexpr size_t builtinCount = sizeof(builtins) / sizeof(builtins[0]);
+		// Bucket of a name, change the factors when a new name collides
+		constexpr size_t builtinBuckets = 16;
+		constexpr size_t builtinBucket(std::string_view name) {
+			return (2 * (unsigned char)name.front() + 5 * (unsigned char)name.back() + 5 * name.size()) % builtinBuckets;
+		}
+		// Built in of each bucket, -1 if empty
+		struct BuiltinTable {
+			int index[builtinBuckets];
+		};
+		constexpr BuiltinTable makeBuiltinTable() {
+			BuiltinTable table{};
+			for (size_t b = 0; b < builtinBuckets; b++) {
+				table.index[b] = -1;
+			}
+			for (size_t i = 0; i < builtinCount; i++) {
+				table.index[builtinBucket(builtins[i].name)] = (int)i;
+			}
+			return table;
+		}
+		constexpr BuiltinTable builtinTable = makeBuiltinTable();
+		constexpr bool builtinsCollide() {
+			for (size_t i = 0; i < builtinCount; i++) {
+				if (builtinTable.index[builtinBucket(builtins[i].name)] != (int)i) {
+					return true;
+				}
+			}
+			return false;
+		}
+		static_assert(!builtinsCollide(), "Every built in name needs a bucket of its own");
+		// Find a built in by lowercase name, null if there is none
+		const Builtin* findBuiltin(std::string_view name) {
+			if (name.empty()) {
+				return nullptr;
+			}
+			int index = builtinTable.index[builtinBucket(name)];
+			return index >= 0 && builtins[index].name == name ? &builtins[index] : nullptr;
+		}
+		// Whether a number from_chars found out of range is too small rather than too large, from the power of ten of
+		// its leading digit e.g. 1e-50 and 0.001e-48 are too small, 1e50 is too large
+		bool isUnderflow(std::string_view number) {
+			size_t i = 0;
+			long long power = -1;
+			bool leading = true;
+			for (; i < number.size() && std::isdigit((unsigned char)number[i]); i++) {
+				if (number[i] != '0' || !leading) {
+					leading = false;
+					power++;
+				}
+			}
+			if (i < number.size() && number[i] == '.') {
+				for (i++; i < number.size() && std::isdigit((unsigned char)number[i]); i++) {
+					if (!leading) {
+						break;
+					}
+					if (number[i] != '0') {
+						leading = false;
+					} else {
+						power--;
+					}
+				}
+				while (i < number.size() && std::isdigit((unsigned char)number[i])) {
+					i++;
+				}
+			}
+			if (i < number.size() && (number[i] == 'e' || number[i] == 'E')) {
+				i++;
+				bool negative = i < number.size() && number[i] == '-';
+				if (i < number.size() && (number[i] == '-' || number[i] == '+')) {
+					i++;
+				}
+				long long exponent = 0;
+				if (std::from_chars(number.data() + i, number.data() + number.size(), exponent).ec == std::errc::result_out_of_range) {
+					return negative;
+				}
+				power += negative ? -exponent : exponent;
+			}
+			return power < 0;
+		}
+	}
+
+	// Program of an expression never set or that failed to compile
+	template <typename T>
+	const std::shared_ptr<const typename Expression<T>::Program>& Expression<T>::emptyProgram() {
+		static const std::shared_ptr<const Program> empty = std::make_shared<const Program>();
+		return empty;
+	}
+
+	// Functions registered with define(), shared by every expression of this type
+	template <typename T>
+	typename Expression<T>::Registry& Expression<T>::registry() {
+		static Registry registry;
+		return registry;
+	}
+
+	// Same operation on the same operands
+	template <typename T>
+	bool Expression<T>::Instruction::operator==(const Instruction& other) const {
+		// Compare signs too so 0 and -0 stay distinct
+		return op == other.op && a == other.a && b == other.b && fn == other.fn
+			&& value == other.value && std::signbit(value) == std::signbit(other.value);
+	}
+
+	// Hash of an instruction for finding repeated subexpressions
+	template <typename T>
+	size_t Expression<T>::InstructionHash::operator()(const Instruction& instruction) const {
+		// Mix each field in so neighbouring registers spread over the buckets
+		size_t hash = 0;
+		auto combine = [&](size_t value) {
+			hash ^= value + 0x9E3779B9 + (hash << 6) + (hash >> 2);
+		};
+		combine(std::hash<int>()((int)instruction.op));
+		combine(std::hash<int>()(instruction.a));
+		combine(std::hash<int>()(instruction.b));
+		combine(std::hash<T>()(instruction.value));
+		combine(std::hash<size_t>()(reinterpret_cast<size_t>(instruction.fn)));
+		return hash;
+	}
+
+	// Whether there is no problem
+	template <typename T>
+	bool Expression<T>::Diagnostic::ok() const {
+		return message.empty();
+	}
+
+	// Least recently used compiled programs, shared by every expression
+	template <typename T>
+	typename Expression<T>::Cache& Expression<T>::cache() {
+		static Cache programs;
+		return programs;
+	}
+
+	// Append the expression string to a key
+	// Case and whitespace do not change the tokens, except that whitespace keeps two names or numbers apart
+	template <typename T>
+	void Expression<T>::normalize(std::string_view input, std::string& key) {
+		auto word = [](char c) { return std::isalnum((unsigned char)c) || c == '.'; };
+		size_t start = key.size();
+		bool space = false;
+		for (char c : input) {
+			if (std::isspace((unsigned char)c)) {
+				space = true;
+				continue;
+			}
+			if (space && key.size() > start && word(key.back()) && word(c)) {
+				key += ' ';
+			}
+			space = false;
+			key += (char)std::tolower((unsigned char)c);
+		}
+	}
+
+	// Find a program and mark it most recently used
+	template <typename T>
+	std::shared_ptr<const typename Expression<T>::Program> Expression<T>::cacheFind(const std::string& key) {
+		Cache& programs = cache();
+		std::lock_guard<std::mutex> lock(programs.mutex);
+		if (programs.stats.capacity == 0) {
+			return nullptr;
+		}
+		typename std::unordered_map<std::string, typename Cache::Entries::iterator>::iterator iterC = programs.index.find(key);
+		if (iterC == programs.index.end()) {
+			++programs.stats.misses;
+			return nullptr;
+		}
+		++programs.stats.hits;
+		programs.entries.splice(programs.entries.begin(), programs.entries, iterC->second);
+		return iterC->second->second;
+	}
+
+	// Add a program to the cache
+	template <typename T>
+	void Expression<T>::cacheStore(const std::string& key, const std::shared_ptr<const Program>& program) {
+		Cache& programs = cache();
+		std::lock_guard<std::mutex> lock(programs.mutex);
+		if (programs.stats.capacity == 0 || programs.index.count(key) != 0) {
+			return;
+		}
+		programs.entries.emplace_front(key, program);
+		programs.index[key] = programs.entries.begin();
+		while (programs.entries.size() > programs.stats.capacity) {
+			programs.index.erase(programs.entries.back().first);
+			programs.entries.pop_back();
+		}
+		programs.stats.size = programs.entries.size();
+	}
+
+	// Get a program with other values for its slots when compiled
+	template <typename T>
+	std::shared_ptr<const typename Expression<T>::Program> Expression<T>::withDefaults(const std::shared_ptr<const Program>& program, const std::vector<T>& defaults) {
+		if (program->slotDefaults == defaults) {
+			return program;
+		}
+		std::shared_ptr<Program> copy = std::make_shared<Program>(*program);
+		copy->slotDefaults = defaults;
+		return copy;
+	}
+
+	// Prefix of the keys of programs compiled with the current settings
+	template <typename T>
+	std::string Expression<T>::cachePrefix() const {
+		return { jit ? 'n' : 'i', (char)('0' + (int)accuracy) };
+	}
+
+	// Set how many compiled programs the cache holds
+	template <typename T>
+	void Expression<T>::setCacheCapacity(size_t capacity) {
+		Cache& programs = cache();
+		std::lock_guard<std::mutex> lock(programs.mutex);
+		programs.stats.capacity = capacity;
+		while (programs.entries.size() > capacity) {
+			programs.index.erase(programs.entries.back().first);
+			programs.entries.pop_back();
+		}
+		programs.stats.size = programs.entries.size();
+	}
+
+	// Get the counters of the cache
+	template <typename T>
+	typename Expression<T>::CacheStats Expression<T>::cacheStats() {
+		Cache& programs = cache();
+		std::lock_guard<std::mutex> lock(programs.mutex);
+		return programs.stats;
+	}
+
+	// Drop every program from the cache
+	template <typename T>
+	void Expression<T>::clearCache() {
+		Cache& programs = cache();
+		std::lock_guard<std::mutex> lock(programs.mutex);
+		programs.entries.clear();
+		programs.index.clear();
+		programs.stats.size = 0;
+	}
+
+	// Register a function callable from every expression of this type
+	template <typename T>
+	bool Expression<T>::define(std::string_view name, FnPtr scalar, BatchFn batch) {
+		// Same form as an identifier, a letter followed by letters and digits
+		if (name.empty() || scalar == nullptr || !std::isalpha((unsigned char)name.front())
+			|| !std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum((unsigned char)c) != 0; })) {
+			return false;
+		}
+		std::string lower(name);
+		std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+		if (findBuiltin(lower) != nullptr) {
+			return false;
+		}
+		{
+			Registry& functions = registry();
+			std::lock_guard<std::mutex> lock(functions.mutex);
+			functions.functions[lower] = { scalar, batch };
+		}
+		// Cached programs may call the function this one replaces
+		clearCache();
+		return true;
+	}
+
 	// Peek next token, bounds check
 	template<typename T>
 	typename Expression<T>::Token Expression<T>::peek() {
 		Token t = Token::None;
-		if (indexTok < tokens.size()) {
+		if (indexTok < tokens.size() && problem.ok()) {
 			t = tokens[indexTok];
 		}
 		return t;
 	}
 
-	// [v]alue = literal | (e)
+	// Record the first problem
+	// Later problems are only consequences of it, peek() returning None unwinds the parser without exceptions
 	template <typename T>
-	T Expression<T>::parseValue() {
-		T expression = 0;
-		if (peek() == Token::Literal) {
-			expression = literals[indexLit++];
-			++indexTok;
-		} else if (peek() == Token::OpenP) {
-			// Consume
-			++indexTok;
-			try {
-				expression = parseExpression();
-			} catch (std::exception& e) {
-				std::cout << e.what() << "\n";
-			}
-			// Mandate syntax
-			if (peek() != Token::ClosedP) {
-				// TODO this isnt invalidating the isValid function
-				throw std::runtime_error("ERROR::EXPRUTIL: Open parenthesis has no matching closed parenthesis.");;
-			}
-			// Consume RParens
-			++indexTok;
+	void Expression<T>::fail(size_t position, const std::string& message) {
+		if (problem.ok()) {
+			problem.position = position;
+			problem.message = message;
 		}
-		return expression;
 	}
-	// [p]ower = function(v) | variable | v
+
+	// Offset into the expression string of the next token
 	template <typename T>
-	T Expression<T>::parsePower() {
-		T value = 0;
-		// Check sign
-		int sign = 1;
-		if (peek() == Token::Minus) {
-			// Consume and change sign
-			++indexTok;
-			sign = -1;
+	size_t Expression<T>::tokenPosition() const {
+		return indexTok < positions.size() ? positions[indexTok] : expressionString.size();
+	}
+
+	// Append an instruction to the program and return its register
+	template <typename T>
+	int Expression<T>::emit(Instruction instruction) {
+		building->instructions.push_back(instruction);
+		return (int)building->instructions.size() - 1;
+	}
+
+	// Call of a function at an accuracy
+	template <typename T>
+	typename Expression<T>::Instruction Expression<T>::call(Function function, Accuracy accuracy, int a) {
+		MathFunction<T> implementation = mathFunction<T>(function, accuracy);
+		Instruction instruction{ Op::Call };
+		instruction.a = a;
+		instruction.function = function;
+		instruction.fn = implementation.scalar;
+		instruction.batch = implementation.batch;
+		return instruction;
+	}
+
+	// How tightly a binary operator binds, higher first
+	template <typename T>
+	int Expression<T>::precedence(Op op) {
+		switch (op) {
+		case Op::Pow:
+			return 3;
+		case Op::Multiply:
+		case Op::Divide:
+			return 2;
+		default:
+			return 1;
 		}
-		// If the next token is a string
-		if (peek() == Token::String) {
-			++indexTok;
-			// Check if it is a variable or a function name
-			if (peek() == Token::OpenP) {
-				// If this is a function, execute associated function
-				typename std::unordered_map<std::string, FnPtr>::iterator iterF = funcMap.find(strings[indexStr++]);
-				if (iterF == funcMap.end()) {
-					throw std::runtime_error("ERROR::EXPRUTIL: Function " + strings[indexStr - 1] + " does not exist.");
-				} else {
-					value = iterF->second(parseValue());
+	}
+
+	// Parse the tokens into instructions
+	// [e]xpression = e + t | e - t | t
+	// [t]erm = t * f | t / f | f
+	// [f]actor = p ^ f | p
+	// [p]ower = [-] function(e) | [-] function(e, ..., e) | [-] reduction(name, e, e, e) | [-] variable | [-] v
+	// [v]alue = literal | (e)
+	// Runs as a loop over the tokens rather than a function per rule, so deeply nested input only grows the stacks.
+	// Operators wait on a stack until one binding less tightly or the end of their parentheses arrives, which emits
+	// the instructions in the same order the grammar gives them.
+	// A sum or product emits its first and last values, a Loop, the term, then the Sum or Product and a Next, so the
+	// term is compiled once and run once per pass however many passes there are
+	template <typename T>
+	int Expression<T>::parseExpression() {
+		frames.assign(1, Frame());
+		operators.clear();
+		operands.clear();
+		counters.clear();
+		// Emit the operators of the innermost frame binding at least as tightly as binding
+		auto reduce = [&](int binding) {
+			while (operators.size() > frames.back().operators && precedence(operators.back()) >= binding) {
+				Instruction instruction{ operators.back() };
+				operators.pop_back();
+				instruction.b = operands.back();
+				operands.pop_back();
+				instruction.a = operands.back();
+				operands.back() = emit(instruction);
+			}
+		};
+		auto negate = [&]() {
+			Instruction negation{ Op::Negate };
+			negation.a = operands.back();
+			operands.back() = emit(negation);
+		};
+		// Replace the two operands on top by an instruction applied to them
+		auto combine = [&](Op op) {
+			Instruction instruction{ op };
+			instruction.b = operands.back();
+			operands.pop_back();
+			instruction.a = operands.back();
+			operands.back() = emit(instruction);
+		};
+		// Take in the argument just parsed, false once the function has too many
+		auto argument = [&](Frame& frame, bool last) {
+			switch (frame.op) {
+			case Op::Min:
+			case Op::Max:
+				// Fold each argument into the ones before it, left to right
+				if (operands.size() - frame.operands == 2) {
+					combine(frame.op);
 				}
-			} else {
-				// This is a variable, if there actually are variables
-				if (!variables.empty()) {
-					typename std::unordered_map<std::string, T>::iterator iterV = variables.find(strings[indexStr]);
-					if (iterV != variables.end()) {
-						// Found, get associated value
-						value = iterV->second;
-						++indexStr;
+				return true;
+			case Op::Atan2:
+				// Closes after the second argument and not before
+				if (last != (frame.arguments == 2)) {
+					return false;
+				}
+				if (last) {
+					combine(Op::Atan2);
+				}
+				return true;
+			case Op::Sum:
+			case Op::Product: {
+				// The counter was the first argument, then come the first and last values and the term
+				if (last != (frame.arguments == 4)) {
+					return false;
+				}
+				if (frame.arguments == 3) {
+					// Start the loop, the term sees the counter as a variable
+					Instruction loop{ Op::Loop };
+					loop.b = operands.back();
+					operands.pop_back();
+					loop.a = operands.back();
+					operands.pop_back();
+					frame.loop = emit(loop);
+					counters.emplace_back(frame.counter, frame.loop);
+				} else if (frame.arguments == 4) {
+					Instruction reduction{ frame.op };
+					reduction.a = frame.loop;
+					reduction.b = operands.back();
+					operands.back() = emit(reduction);
+					Instruction next{ Op::Next };
+					next.a = frame.loop;
+					emit(next);
+					counters.pop_back();
+				}
+				return true;
+			}
+			case Op::Call:
+				if (last) {
+					Instruction function = frame.call;
+					function.a = operands.back();
+					operands.back() = emit(function);
+				}
+				return last;
+			default:
+				return last;
+			}
+		};
+		auto argumentsProblem = [&](const Frame& frame) {
+			const std::string& name = names[frame.name];
+			switch (frame.op) {
+			case Op::Sum:
+			case Op::Product:
+				return "Function " + name + " takes a counter, its first and last values and a term e.g. " + name + "(k, 1, 10, k^2).";
+			case Op::Atan2:
+				return "Function " + name + " takes 2 arguments.";
+			default:
+				return "Function " + name + " takes 1 argument.";
+			}
+		};
+		for (;;) {
+			// Operand, with its sign
+			bool negative = false;
+			if (peek() == Token::Minus) {
+				// Consume and change sign
+				++indexTok;
+				negative = true;
+			}
+			Frame frame;
+			frame.operators = operators.size();
+			frame.operands = operands.size();
+			frame.negative = negative;
+			if (peek() == Token::OpenP) {
+				// Consume and parse the contents as a frame of their own
+				++indexTok;
+				frames.push_back(frame);
+				continue;
+			}
+			if (peek() == Token::Literal) {
+				Instruction literal{ Op::Literal };
+				literal.value = literals[indexLit++];
+				operands.push_back(emit(literal));
+				++indexTok;
+			} else if (peek() == Token::String) {
+				++indexTok;
+				// Check if it is a counter, a variable or a function name
+				int nameIndex = strings[indexStr++];
+				const std::string& name = names[nameIndex];
+				const Builtin* builtin = findBuiltin(name);
+				if (peek() == Token::OpenP) {
+					frame.name = nameIndex;
+					frame.position = positions[indexTok - 1];
+					// If this is a function, resolve it once here rather than on every solve
+					// Built in functions come first, then those registered with define()
+					if (builtin != nullptr && builtin->kind == Kind::Function) {
+						frame.op = Op::Call;
+						frame.call = call(builtin->function, accuracy, 0);
+					} else if (builtin != nullptr && builtin->kind != Kind::Constant) {
+						frame.op = builtin->kind == Kind::Sum ? Op::Sum : builtin->kind == Kind::Product ? Op::Product
+							: builtin->kind == Kind::Minimum ? Op::Min : builtin->kind == Kind::Maximum ? Op::Max : Op::Atan2;
 					} else {
-						// Map has variables but this one wasn't provided
-						throw std::runtime_error("ERROR::EXPRUTIL: A variable wasn't initialized.");
+						Registry& functions = registry();
+						std::lock_guard<std::mutex> lock(functions.mutex);
+						typename std::unordered_map<std::string, UserFunction>::const_iterator iterF = functions.functions.find(name);
+						if (iterF == functions.functions.end()) {
+							fail(positions[indexTok - 1], "Function " + name + " does not exist.");
+							return 0;
+						}
+						frame.op = Op::Call;
+						frame.call.function = Function::User;
+						frame.call.fn = iterF->second.scalar;
+						frame.call.batch = iterF->second.batch;
+					}
+					// Consume and parse the arguments as a frame of their own
+					++indexTok;
+					if (frame.op == Op::Sum || frame.op == Op::Product) {
+						// The counter comes first as a bare name
+						if (peek() != Token::String || indexTok + 1 >= tokens.size() || tokens[indexTok + 1] != Token::Comma) {
+							fail(frame.position, argumentsProblem(frame));
+							return 0;
+						}
+						frame.counter = strings[indexStr++];
+						indexTok += 2;
+						frame.arguments = 2;
 					}
+					frames.push_back(frame);
+					continue;
+				}
+				// The counter of a sum or product being parsed, the innermost one of that name
+				std::vector<std::pair<int, int>>::reverse_iterator iterC = std::find_if(counters.rbegin(), counters.rend(),
+					[&](const std::pair<int, int>& counter) { return counter.first == nameIndex; });
+				if (iterC != counters.rend()) {
+					operands.push_back(iterC->second);
+				}
+				// This is a variable, resolve it to its slot
+				// Constants are literals, taking their value from a variable of the same name if there is one
+				else if (builtin != nullptr && builtin->kind == Kind::Constant) {
+					typename std::unordered_map<std::string, T>::iterator iterV = variables.find(name);
+					Instruction constant{ Op::Literal };
+					constant.value = iterV != variables.end() ? iterV->second : T(builtin->value);
+					operands.push_back(emit(constant));
 				} else {
-					// Variable map is empty
-					throw std::runtime_error("ERROR::EXPRUTIL: No variables provided or function is missing parenthesis.");
+					Instruction variable{ Op::Variable };
+					variable.a = intern(name, positions[indexTok - 1]);
+					operands.push_back(emit(variable));
 				}
+			} else {
+				fail(tokenPosition(), "Expected a number, variable or parenthesis.");
+				return 0;
 			}
-		} else {
-			// Otherwise get the factor without any function
-			try {
-				value = parseValue();
-			} catch (std::exception& e) {
-				std::cout << e.what() << "\n";
-			}
-		}
-		return sign * value;
-	}
-	// [f]actor = f ^ p | p
-	template <typename T>
-	T Expression<T>::parseFactor() {
-		T power = parsePower();
-		// Check if this is an exponent
-		if (peek() == Token::Pow) {
-			// Build a stack of powers in case there is more than one
-			// This acounts for the intuition that 2 ^ 2 ^ 2 ^ 2 = 2 ^ (2 ^ (2 ^ 2))
-			powerStack.clear();
-			powerStack.push_back(power);
-			while (peek() == Token::Pow) {
-				// Consume and add to stack
+			if (negative) {
+				negate();
+			}
+			// Close every frame ending here, until a binary operator, an argument separator or the end of the expression
+			Token next = peek();
+			while (next != Token::Plus && next != Token::Minus && next != Token::Multiply && next != Token::Divide && next != Token::Pow && next != Token::Comma) {
+				reduce(0);
+				if (frames.size() == 1) {
+					return operands.back();
+				}
+				// Mandate syntax
+				if (next != Token::ClosedP) {
+					fail(tokenPosition(), "Open parenthesis has no matching closed parenthesis.");
+					return 0;
+				}
+				// Consume RParens
 				++indexTok;
-				try {
-					powerStack.push_back(parsePower());
-				} catch (std::exception& e) {
-					std::cout << e.what() << "\n";
+				Frame& closed = frames.back();
+				if (closed.op != Op::Literal && !argument(closed, true)) {
+					fail(closed.position, argumentsProblem(closed));
+					return 0;
 				}
+				if (closed.negative) {
+					negate();
+				}
+				frames.pop_back();
+				next = peek();
 			}
-			// Evaluate first two normally
-			power = std::pow(powerStack[powerStack.size() - 2], powerStack[powerStack.size() - 1]);
-			// Evaluate the rest moving backwards
-			for (auto iter = powerStack.end() - 2; iter != powerStack.begin(); --iter) {
-				power = std::pow(*iter, power);
+			// Start on the next argument once the one before it is complete
+			if (next == Token::Comma) {
+				Frame& open = frames.back();
+				if (open.op == Op::Literal) {
+					fail(tokenPosition(), "Comma outside of the arguments of a function.");
+					return 0;
+				}
+				reduce(0);
+				if (!argument(open, false)) {
+					fail(open.position, argumentsProblem(open));
+					return 0;
+				}
+				++open.arguments;
+				++indexTok;
+				continue;
 			}
+			// Consume the operator once those binding at least as tightly are emitted
+			// Pow waits for those on its right, accounting for the intuition that 2 ^ 2 ^ 2 ^ 2 = 2 ^ (2 ^ (2 ^ 2))
+			Op op = next == Token::Plus ? Op::Add : next == Token::Minus ? Op::Subtract : next == Token::Multiply ? Op::Multiply : next == Token::Divide ? Op::Divide : Op::Pow;
+			++indexTok;
+			reduce(op == Op::Pow ? precedence(op) + 1 : precedence(op));
+			operators.push_back(op);
 		}
-		return power;
 	}
-	// [t]erm = t * f | t / f | f
+
+	// Number of registers an instruction reads
 	template <typename T>
-	T Expression<T>::parseTerm() {
-		T factor = parseFactor();
-		while (peek() == Token::Multiply || peek() == Token::Divide) {
-			if (peek() == Token::Multiply) {
-				// Consume and multiply
-				++indexTok;
-				try {
-					factor = factor * parseFactor();
-				} catch (std::exception& e) {
-					std::cout << e.what() << "\n";
+	int Expression<T>::arity(Op op) {
+		switch (op) {
+		case Op::Literal:
+		case Op::Variable:
+			return 0;
+		case Op::Negate:
+		case Op::Call:
+		case Op::Next:
+			return 1;
+		default:
+			return 2;
+		}
+	}
+
+	// Smaller of two values, NaN if either is not a number
+	template <typename T>
+	T Expression<T>::minimum(T a, T b) {
+		return b < a || std::isnan(b) ? b : a;
+	}
+
+	// Larger of two values, NaN if either is not a number
+	template <typename T>
+	T Expression<T>::maximum(T a, T b) {
+		return a < b || std::isnan(b) ? b : a;
+	}
+
+	// Angle of the point (b, a) from the x axis
+	template <typename T>
+	T Expression<T>::arctangent(T a, T b) {
+		return std::atan2(a, b);
+	}
+
+	// 1 if a is less than b, otherwise 0
+	template <typename T>
+	T Expression<T>::less(T a, T b) {
+		return a < b ? T(1) : T(0);
+	}
+
+	// Counter of the first pass of a loop
+	// Counting stays exact while both ends are at most 1 / epsilon from zero
+	template <typename T>
+	T Expression<T>::loopStart(T first, T last) {
+		const T exact = 1 / std::numeric_limits<T>::epsilon();
+		if (!(std::abs(first) <= exact && std::abs(last) <= exact && last - first < T(MaxPasses))) {
+			return std::numeric_limits<T>::quiet_NaN();
+		}
+		return first;
+	}
+
+	// Whether a loop makes another pass after the one with counter k
+	template <typename T>
+	bool Expression<T>::loopAgain(T k, T last) {
+		return k + 1 <= last;
+	}
+
+	// Fold the term of a pass into a sum or product
+	// The first pass starts the accumulator, or leaves it empty if the loop has no passes
+	template <typename T>
+	T Expression<T>::accumulate(Op op, T accumulator, T term, T k, T first, T last) {
+		if (std::isnan(k)) {
+			return k;
+		}
+		if (k > last) {
+			return k != first ? accumulator : op == Op::Sum ? T(0) : T(1);
+		}
+		if (k == first) {
+			return term;
+		}
+		return op == Op::Sum ? accumulator + term : accumulator * term;
+	}
+
+	// Fold the derivative of the term of a pass into the derivative of a sum or product
+	// A factor that does not change adds nothing, even where the other one is infinite or not a number
+	template <typename T>
+	T Expression<T>::accumulateDerivative(Op op, T accumulator, T term, T dAccumulator, T dTerm, T k, T first, T last) {
+		if (std::isnan(k)) {
+			return k;
+		}
+		if (k > last) {
+			return k != first ? dAccumulator : T(0);
+		}
+		if (k == first) {
+			return dTerm;
+		}
+		if (op == Op::Sum) {
+			return dAccumulator + dTerm;
+		}
+		return (dAccumulator != 0 ? dAccumulator * term : T(0)) + (dTerm != 0 ? accumulator * dTerm : T(0));
+	}
+
+	// Apply an instruction to the values of its operands
+	// Loops need the passes before them and only run in the solvers
+	template <typename T>
+	T Expression<T>::apply(const Instruction& instruction, T a, T b) {
+		switch (instruction.op) {
+		case Op::Literal:
+			return instruction.value;
+		case Op::Negate:
+			return -a;
+		case Op::Add:
+			return a + b;
+		case Op::Subtract:
+			return a - b;
+		case Op::Multiply:
+			return a * b;
+		case Op::Divide:
+			return a / b;
+		case Op::Pow:
+			return std::pow(a, b);
+		case Op::Call:
+			return instruction.fn(a);
+		case Op::Min:
+			return minimum(a, b);
+		case Op::Max:
+			return maximum(a, b);
+		case Op::Atan2:
+			return arctangent(a, b);
+		case Op::Less:
+			return less(a, b);
+		default:
+			return 0;
+		}
+	}
+
+	// Apply an instruction to the ranges of its operands
+	// Arithmetic rounds to nearest like solve() does, which never reverses the order of two values, so the bounds
+	// computed from the ends hold for every point. Library functions are not guaranteed to be monotonic to the last
+	// bit, so their bounds are moved outward by an ulp
+	template <typename T>
+	typename Expression<T>::Interval Expression<T>::applyInterval(const Instruction& instruction, Accuracy accuracy, Interval a, Interval b) {
+		const T inf = std::numeric_limits<T>::infinity();
+		const T nan = std::numeric_limits<T>::quiet_NaN();
+		const Interval unknown = { nan, nan };
+		const Interval all = { -inf, inf };
+		auto widen = [&](Interval range) {
+			return Interval{ std::nextafter(range.lo, -inf), std::nextafter(range.hi, inf) };
+		};
+		auto contains = [](Interval range, T value) {
+			return range.lo <= value && value <= range.hi;
+		};
+		// Whether a range reaches either infinity, which the value may then be
+		auto unbounded = [](Interval range) {
+			return std::isinf(range.lo) || std::isinf(range.hi);
+		};
+		// Smallest range holding every value, unknown if any of them is not a number
+		auto hull = [&](std::initializer_list<T> values) {
+			Interval range = { inf, -inf };
+			for (T value : values) {
+				if (std::isnan(value)) {
+					return unknown;
 				}
-			} else if (peek() == Token::Divide) {
-				// Consume and divide
-				++indexTok;
-				try {
-					factor = factor / parseFactor();
-				} catch (std::exception& e) {
-					std::cout << e.what() << "\n";
+				range.lo = std::min(range.lo, value);
+				range.hi = std::max(range.hi, value);
+			}
+			return range;
+		};
+		int operands = arity(instruction.op);
+		if ((operands > 0 && std::isnan(a.lo)) || (operands > 1 && std::isnan(b.lo))) {
+			return unknown;
+		}
+		switch (instruction.op) {
+		case Op::Literal:
+			return { instruction.value, instruction.value };
+		case Op::Negate:
+			return { -a.hi, -a.lo };
+		// inf - inf, 0 * inf and inf / inf are not numbers even where no corner of the box gives one
+		case Op::Add:
+			if ((a.hi == inf && b.lo == -inf) || (a.lo == -inf && b.hi == inf)) {
+				return unknown;
+			}
+			return hull({ a.lo + b.lo, a.hi + b.hi });
+		case Op::Subtract:
+			if ((a.hi == inf && b.hi == inf) || (a.lo == -inf && b.lo == -inf)) {
+				return unknown;
+			}
+			return hull({ a.lo - b.hi, a.hi - b.lo });
+		case Op::Multiply:
+			if ((contains(a, 0) && unbounded(b)) || (unbounded(a) && contains(b, 0))) {
+				return unknown;
+			}
+			return hull({ a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi });
+		case Op::Divide:
+			if (unbounded(a) && unbounded(b)) {
+				return unknown;
+			}
+			if (contains(b, 0)) {
+				// 0 / 0 may come up, anything else over a range crossing zero is unbounded
+				return contains(a, 0) ? unknown : all;
+			}
+			return hull({ a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi });
+		case Op::Pow: {
+			if (b.lo == b.hi && b.lo == std::floor(b.lo) && std::abs(b.lo) < 1 << 24) {
+				// Whole power, odd ones keep the order and even ones are the power of the distance from zero
+				long long n = (long long)b.lo;
+				if (n == 0) {
+					return { 1, 1 };
+				}
+				Interval base = a;
+				if (n % 2 == 0 && contains(a, 0)) {
+					base = { 0, std::max(-a.lo, a.hi) };
+				} else if (n % 2 == 0 && a.hi < 0) {
+					base = { -a.hi, -a.lo };
+				}
+				if (n < 0 && contains(base, 0)) {
+					return n % 2 == 0 ? Interval{ 0, inf } : all;
 				}
+				return widen(hull({ std::pow(base.lo, b.lo), std::pow(base.hi, b.lo) }));
 			}
+			// Otherwise a negative base is not a number, and a positive one has its extremes at the corners
+			if (a.lo < 0) {
+				return unknown;
+			}
+			// A zero base, which may be -0, gives an infinity of either sign for a negative power
+			if (a.lo == 0 && b.lo < 0) {
+				return all;
+			}
+			return widen(hull({ std::pow(a.lo, b.lo), std::pow(a.lo, b.hi), std::pow(a.hi, b.lo), std::pow(a.hi, b.hi) }));
 		}
-		return factor;
-	}
-	// [e]xpression = t + e | t - e | t
-	template <typename T>
-	T Expression<T>::parseExpression() {
-		T term = parseTerm();
-		while (peek() == Token::Plus || peek() == Token::Minus) {
-			if (peek() == Token::Plus) {
-				// Consume and add
-				++indexTok;
-				try {
-					term = term + parseTerm();
-				} catch (std::exception& e) {
-					std::cout << e.what() << "\n";
+		case Op::Min:
+			return { std::min(a.lo, b.lo), std::min(a.hi, b.hi) };
+		case Op::Max:
+			return { std::max(a.lo, b.lo), std::max(a.hi, b.hi) };
+		case Op::Less:
+			return a.hi < b.lo ? Interval{ 1, 1 } : a.lo >= b.hi ? Interval{ 0, 0 } : Interval{ 0, 1 };
+		case Op::Atan2: {
+			const T pi = T(std::acos(-1.0));
+			return widen({ -pi, pi });
+		}
+		case Op::Loop:
+			// Every counter from the first value up to the last, or the first alone if there are no passes
+			// Unknown if some point in the box makes too many passes
+			if (loopStart(a.lo, b.hi) != a.lo || loopStart(a.hi, b.lo) != a.hi) {
+				return unknown;
+			}
+			return { a.lo, std::max(a.hi, b.hi) };
+		case Op::Next:
+			return { 0, 0 };
+		case Op::Call:
+			break;
+		default:
+			return unknown;
+		}
+		// Functions, unknown ones get no bounds
+		FnPtr fn = instruction.fn;
+		auto bound = [&]() -> Interval {
+			switch (instruction.function) {
+			case Function::Sin:
+			case Function::Cos: {
+				const double twoPi = 2 * std::acos(-1.0);
+				// Peaks of sin are at pi/2 + 2k pi and troughs at -pi/2 + 2k pi, cos is a quarter turn earlier
+				double offset = instruction.function == Function::Sin ? twoPi / 4 : 0;
+				// Not a number at either infinity
+				if (unbounded(a)) {
+					return unknown;
 				}
-			} else if (peek() == Token::Minus) {
-				// Consume and subtract
-				++indexTok;
-				try {
-					term = term - parseTerm();
-				} catch (std::exception& e) {
-					std::cout << e.what() << "\n";
+				if (a.hi - a.lo >= twoPi) {
+					return { -1, 1 };
+				}
+				auto reaches = [&](double at) {
+					return std::ceil((a.lo - at) / twoPi) <= std::floor((a.hi - at) / twoPi);
+				};
+				Interval range = widen(hull({ fn(a.lo), fn(a.hi) }));
+				if (reaches(offset)) {
+					range.hi = 1;
+				}
+				if (reaches(offset + twoPi / 2)) {
+					range.lo = -1;
+				}
+				return range;
+			}
+			case Function::Tan: {
+				// Increasing between poles at pi/2 + k pi
+				const double pi = std::acos(-1.0);
+				if (unbounded(a)) {
+					return unknown;
+				}
+				if (a.hi - a.lo >= pi || std::ceil((a.lo - pi / 2) / pi) <= std::floor((a.hi - pi / 2) / pi)) {
+					return all;
+				}
+				return widen({ fn(a.lo), fn(a.hi) });
+			}
+			case Function::Exp:
+				return widen({ fn(a.lo), fn(a.hi) });
+			case Function::Log:
+			case Function::Sqrt:
+				// Not a number below zero
+				if (a.lo < 0) {
+					return unknown;
 				}
+				return widen({ fn(a.lo), fn(a.hi) });
+			case Function::Abs:
+				if (contains(a, 0)) {
+					return { 0, std::max(-a.lo, a.hi) };
+				}
+				return a.lo > 0 ? a : Interval{ -a.hi, -a.lo };
+			default:
+				return unknown;
 			}
+		};
+		Interval range = bound();
+		// Below exact accuracy both the ends and every value between them may be off by the error of the function
+		T relative, absolute;
+		mathError(accuracy, relative, absolute);
+		if (instruction.function != Function::Abs && instruction.function != Function::Sqrt && !std::isnan(range.lo)) {
+			T error = 2 * (relative * std::max(std::abs(range.lo), std::abs(range.hi)) + absolute);
+			range.lo -= error;
+			range.hi += error;
 		}
-		return term;
+		return range;
 	}
 
-	// Tokenize input string
+	// Fold constants, reduce strength, drop identities and merge repeated subexpressions in the program being compiled
+	// Rewrites can move results by an ulp: x^3 becomes x*x*x and x/c becomes x*(1/c)
 	template <typename T>
-	void Expression<T>::tokenize(std::string input) {
-		// Set up temp values
-		char currChar;
-		T literalResult = 0;
-		T fractional = 0;
-		int length = 0;
-		std::string stringResult = "";
-		// Tokenize
-		for (size_t i = 0; i < input.size(); i++) {
-			// For each character
-			switch (input[i]) {
-				// Plus
-			case '+':
-				tokens.push_back(Token::Plus);
-				break;
-				// Minus
-			case '-':
-				tokens.push_back(Token::Minus);
-				break;
-				// Multiply
-			case '*':
-				tokens.push_back(Token::Multiply);
-				break;
-				// Divide
-			case '/':
-				tokens.push_back(Token::Divide);
+	void Expression<T>::optimize() {
+		std::vector<Instruction>& instructions = building->instructions;
+		std::vector<Instruction> optimized;
+		optimized.reserve(instructions.size());
+		// Register each original instruction ended up in
+		std::vector<int> moved(instructions.size());
+		// Every distinct instruction pushed so far, so a repeated one reuses the earlier register
+		// Since operands are registers this merges whole repeated subexpressions, making the program a DAG
+		std::unordered_map<Instruction, int, InstructionHash> pushed;
+		pushed.reserve(instructions.size());
+		int deduplicated = 0;
+		auto push = [&](Instruction instruction) {
+			// Put operands of commutative operations in a fixed order so x*y and y*x match
+			if ((instruction.op == Op::Add || instruction.op == Op::Multiply) && instruction.a > instruction.b) {
+				std::swap(instruction.a, instruction.b);
+			}
+			// Every loop counts on its own even over the same range
+			if (instruction.op == Op::Loop) {
+				optimized.push_back(instruction);
+				return (int)optimized.size() - 1;
+			}
+			// A single lookup both finds a repeat and adds a new instruction
+			std::pair<typename std::unordered_map<Instruction, int, InstructionHash>::iterator, bool> inserted = pushed.emplace(instruction, (int)optimized.size());
+			if (!inserted.second) {
+				++deduplicated;
+				return inserted.first->second;
+			}
+			optimized.push_back(instruction);
+			return (int)optimized.size() - 1;
+		};
+		auto pushOp = [&](Op op, int a, int b) {
+			Instruction instruction{ op };
+			instruction.a = a;
+			instruction.b = b;
+			return push(instruction);
+		};
+		auto pushLiteral = [&](T value) {
+			Instruction literal{ Op::Literal };
+			literal.value = value;
+			return push(literal);
+		};
+		auto isLiteral = [&](int r, T value) {
+			return optimized[r].op == Op::Literal && optimized[r].value == value;
+		};
+		// Whether a value is plus or minus a power of two
+		auto isPowerOfTwo = [](T value) {
+			int exponent = 0;
+			return std::isfinite(value) && std::abs(std::frexp(value, &exponent)) == T(0.5);
+		};
+		// Adding -0 is the only addition of zero that keeps the sign of every zero
+		auto isNegativeZero = [&](int r) {
+			return isLiteral(r, 0) && std::signbit(optimized[r].value);
+		};
+		for (size_t i = 0; i < instructions.size(); i++) {
+			Instruction ins = instructions[i];
+			int operands = arity(ins.op);
+			if (operands > 0) {
+				ins.a = moved[ins.a];
+			}
+			if (operands > 1) {
+				ins.b = moved[ins.b];
+			}
+			int a = ins.a;
+			int b = ins.b;
+			bool constA = operands > 0 && optimized[a].op == Op::Literal;
+			bool constB = operands > 1 && optimized[b].op == Op::Literal;
+			// Fold any instruction whose operands are all known, a loop still has to run its body
+			if (operands > 0 && constA && (operands == 1 || constB) && ins.op != Op::Loop) {
+				moved[i] = pushLiteral(apply(ins, optimized[a].value, operands > 1 ? optimized[b].value : 0));
+				continue;
+			}
+			int result = -1;
+			switch (ins.op) {
+			case Op::Negate:
+				// -(-x) = x
+				if (optimized[a].op == Op::Negate) {
+					result = optimized[a].a;
+				}
 				break;
-				// Power
-			case '^':
-				tokens.push_back(Token::Pow);
+			case Op::Add:
+				// x + (-0) = -0 + x = x, while x + 0 would turn x = -0 into +0
+				if (isNegativeZero(b)) {
+					result = a;
+				} else if (isNegativeZero(a)) {
+					result = b;
+				}
 				break;
-				// Open parenthesis
-			case '(':
-				tokens.push_back(Token::OpenP);
+			case Op::Subtract:
+				// x - 0 = x, -0 - x = -x, while 0 - x would turn x = 0 into +0 instead of -0
+				if (isLiteral(b, 0) && !std::signbit(optimized[b].value)) {
+					result = a;
+				} else if (isNegativeZero(a)) {
+					result = pushOp(Op::Negate, b, 0);
+				}
 				break;
-				// Closed parenthesis
-			case ')':
-				tokens.push_back(Token::ClosedP);
+			case Op::Multiply:
+				// x * 1 = 1 * x = x, x * -1 = -1 * x = -x
+				if (isLiteral(b, 1)) {
+					result = a;
+				} else if (isLiteral(a, 1)) {
+					result = b;
+				} else if (isLiteral(b, -1)) {
+					result = pushOp(Op::Negate, a, 0);
+				} else if (isLiteral(a, -1)) {
+					result = pushOp(Op::Negate, b, 0);
+				}
 				break;
-			default:
-				// If its a letter
-				if (isalpha(input[i])) {
-					stringResult = "";
-					while (isalpha(input[i])) {
-						currChar = input[i];
-						i++;
-						stringResult += currChar;
-					}
-					i--;
-					tokens.push_back(Token::String);
-					strings.push_back(stringResult);
-					break;
+			case Op::Divide:
+				// x / 1 = x, x / c = x * (1 / c) where c is a power of two with a normal reciprocal, the only c for
+				// which multiplying gives exactly the quotient
+				if (isLiteral(b, 1)) {
+					result = a;
+				} else if (constB && isPowerOfTwo(optimized[b].value) && std::isnormal(1 / optimized[b].value)) {
+					result = pushOp(Op::Multiply, a, pushLiteral(1 / optimized[b].value));
 				}
-				// If its a number
-				else if (isdigit(input[i])) {
-					literalResult = 0;
-					length = 0;
-					fractional = 0;
-					while (isdigit(input[i])) {
-						currChar = input[i];
-						i++;
-						literalResult = literalResult * 10 + (currChar - '0');
-					}
-					// Check for a decimal
-					if (input[i] == '.') {
-						currChar = input[i];
-						i++;
-						// Error checking for non-digits or stray decimal separator
-						if (!isdigit(input[i])) {
-							throw std::runtime_error("ERROR::EXPRUTIL: Value following decimal separator is not a digit.");;
+				break;
+			case Op::Pow:
+				// Small integer powers become a chain of multiplications by squaring
+				if (constB && optimized[b].value == std::floor(optimized[b].value) && std::abs(optimized[b].value) <= 16) {
+					int exponent = (int)std::abs(optimized[b].value);
+					if (exponent == 0) {
+						result = pushLiteral(1);
+						break;
+					}
+					int square = a;
+					while (exponent > 0) {
+						if (exponent & 1) {
+							result = result < 0 ? square : pushOp(Op::Multiply, result, square);
 						}
-						// Get the value after the decimal separator
-						while (isdigit(input[i])) {
-							currChar = input[i];
-							i++;
-							fractional = fractional * 10 + (currChar - '0');
-							++length;
+						exponent >>= 1;
+						if (exponent > 0) {
+							square = pushOp(Op::Multiply, square, square);
 						}
-					} else if (isalpha(input[i])) {
-						throw std::runtime_error("ERROR::EXPRUTIL: Value following number is a letter. Multiplication must be explicit.");
 					}
-					if (fractional > 0) {
-						literalResult = literalResult + (fractional / std::pow(10, length));
+					if (optimized[b].value < 0) {
+						result = pushOp(Op::Divide, pushLiteral(1), result);
+					}
+				}
+				break;
+			default:
+				break;
+			}
+			moved[i] = result >= 0 ? result : push(ins);
+		}
+		// Keep only the instructions the result depends on
+		// A sum or product also needs the Next of its loop, which comes after it, so sweep again until none is added
+		int result = moved[building->result];
+		std::vector<bool> live(optimized.size(), false);
+		std::vector<int> nextOf(optimized.size(), -1);
+		for (size_t i = 0; i < optimized.size(); i++) {
+			if (optimized[i].op == Op::Next) {
+				nextOf[optimized[i].a] = (int)i;
+			}
+		}
+		live[result] = true;
+		for (int from = result; from >= 0;) {
+			int again = -1;
+			for (int i = from; i >= 0; i--) {
+				if (live[i]) {
+					const Instruction& ins = optimized[i];
+					int operands = arity(ins.op);
+					if (operands > 0) {
+						live[ins.a] = true;
+					}
+					if (operands > 1) {
+						live[ins.b] = true;
+					}
+					if ((ins.op == Op::Sum || ins.op == Op::Product) && !live[nextOf[ins.a]]) {
+						live[nextOf[ins.a]] = true;
+						again = std::max(again, nextOf[ins.a]);
+					}
+				}
+			}
+			from = again;
+		}
+		// Move what a loop body computes the same on every pass out in front of the outermost loop it does not depend on
+		// Level is the number of loops a value depends on the counters of, a sum or product only varies with the loops
+		// around its own. Each instruction is ordered by where it ends up, hoisted ones just before the Loop they leave
+		std::vector<int> level(optimized.size(), 0);
+		std::vector<int> open;
+		std::vector<std::pair<size_t, size_t>> order;
+		for (size_t i = 0; i < optimized.size(); i++) {
+			if (!live[i]) {
+				continue;
+			}
+			const Instruction& ins = optimized[i];
+			int depth = (int)open.size();
+			int operands = arity(ins.op);
+			size_t position = i * 2 + 1;
+			if (ins.op == Op::Loop) {
+				level[i] = depth + 1;
+				open.push_back((int)i);
+			} else if (ins.op == Op::Sum || ins.op == Op::Product || ins.op == Op::Next) {
+				level[i] = depth - 1;
+				if (ins.op == Op::Next) {
+					open.pop_back();
+				}
+			} else {
+				level[i] = std::max(operands > 0 ? level[ins.a] : 0, operands > 1 ? level[ins.b] : 0);
+				if (level[i] < depth) {
+					position = (size_t)open[level[i]] * 2;
+				}
+			}
+			order.emplace_back(position, i);
+		}
+		std::sort(order.begin(), order.end());
+		std::vector<int> compacted(optimized.size());
+		instructions.clear();
+		for (const std::pair<size_t, size_t>& placed : order) {
+			Instruction ins = optimized[placed.second];
+			int operands = arity(ins.op);
+			if (operands > 0) {
+				ins.a = compacted[ins.a];
+			}
+			if (operands > 1) {
+				ins.b = compacted[ins.b];
+			}
+			compacted[placed.second] = (int)instructions.size();
+			instructions.push_back(ins);
+		}
+		building->result = compacted[result];
+		building->stats.instructions = (int)instructions.size();
+		building->stats.deduplicated = deduplicated;
+	}
+
+	// Find or create the slot of a variable name while compiling
+	template <typename T>
+	int Expression<T>::intern(const std::string& name, size_t position) {
+		std::vector<std::string>& slotNames = building->slotNames;
+		for (size_t i = 0; i < slotNames.size(); i++) {
+			if (slotNames[i] == name) {
+				return (int)i;
+			}
+		}
+		// Start from the value in the map if there is one
+		typename std::unordered_map<std::string, T>::iterator iterV = variables.find(name);
+		slotNames.push_back(name);
+		building->slotDefaults.push_back(iterV != variables.end() ? iterV->second : 0);
+		building->slotPositions.push_back(position);
+		return (int)slotNames.size() - 1;
+	}
+
+	// Find the slot of a variable name
+	template <typename T>
+	int Expression<T>::find(const std::string& name) const {
+		const std::vector<std::string>& slotNames = program->slotNames;
+		for (size_t i = 0; i < slotNames.size(); i++) {
+			if (slotNames[i] == name) {
+				return (int)i;
+			}
+		}
+		// Every context has one extra slot that nothing reads
+		return (int)slotNames.size();
+	}
+
+	// Size the context for a program
+	template <typename T>
+	void Expression<T>::prepare(const Program& program, Context& context) {
+		if (context.slots.size() != program.slotNames.size() + 1) {
+			context.slots.resize(program.slotNames.size() + 1);
+		}
+		if (context.registers.size() != program.instructions.size()) {
+			context.registers.resize(program.instructions.size());
+		}
+	}
+
+	// Fill the slot table of the context for native code
+	// Each slot gets a pair of pointers, its column or null, then its value in the context
+	template <typename T>
+	void Expression<T>::prepareNative(const Program& program, Context& context, const std::vector<T>& slots, const Slot* inputs, const T* const* columns, int columnCount) {
+		size_t registers = program.instructions.size() * (16 / sizeof(T));
+		if (context.nativeRegisters.size() != registers) {
+			context.nativeRegisters.resize(registers);
+		}
+		std::vector<const T*>& nativeSlots = context.nativeSlots;
+		nativeSlots.resize(slots.size() * 2);
+		for (size_t s = 0; s < slots.size(); s++) {
+			nativeSlots[s * 2] = nullptr;
+			nativeSlots[s * 2 + 1] = &slots[s];
+		}
+		for (int c = 0; c < columnCount; c++) {
+			nativeSlots[inputs[c] * 2] = columns[c];
+		}
+	}
+
+	// Find or add the lowercase form of an identifier
+	template <typename T>
+	int Expression<T>::internName(std::string_view identifier) {
+		lowered.assign(identifier.data(), identifier.size());
+		std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+		// Only a name not seen before in this expression allocates
+		std::pair<typename std::unordered_map<std::string, int>::iterator, bool> found = nameIndices.try_emplace(lowered, (int)names.size());
+		if (found.second) {
+			names.push_back(lowered);
+		}
+		return found.first->second;
+	}
+
+	// Tokenize input string
+	template <typename T>
+	void Expression<T>::tokenize(std::string_view input) {
+		const char* const end = input.data() + input.size();
+		// Tokenize
+		for (const char* it = input.data(); it != end && problem.ok();) {
+			size_t start = it - input.data();
+			// For each character
+			switch (*it) {
+				// Plus
+			case '+':
+				tokens.push_back(Token::Plus);
+				++it;
+				break;
+				// Minus
+			case '-':
+				tokens.push_back(Token::Minus);
+				++it;
+				break;
+				// Multiply
+			case '*':
+				tokens.push_back(Token::Multiply);
+				++it;
+				break;
+				// Divide
+			case '/':
+				tokens.push_back(Token::Divide);
+				++it;
+				break;
+				// Power
+			case '^':
+				tokens.push_back(Token::Pow);
+				++it;
+				break;
+				// Open parenthesis
+			case '(':
+				tokens.push_back(Token::OpenP);
+				++it;
+				break;
+				// Closed parenthesis
+			case ')':
+				tokens.push_back(Token::ClosedP);
+				++it;
+				break;
+				// Separator of function arguments
+			case ',':
+				tokens.push_back(Token::Comma);
+				++it;
+				break;
+			default:
+				// If its a letter, intern the whole identifier, which may go on with digits as in atan2
+				if (std::isalpha((unsigned char)*it)) {
+					const char* first = it;
+					while (it != end && std::isalnum((unsigned char)*it)) {
+						++it;
+					}
+					tokens.push_back(Token::String);
+					strings.push_back(internName(std::string_view(first, it - first)));
+				}
+				// If its a number, parse it correctly rounded including any exponent e.g. 1.5e-3
+				else if (std::isdigit((unsigned char)*it) || (*it == '.' && it + 1 != end && std::isdigit((unsigned char)it[1]))) {
+					T literal = 0;
+					std::from_chars_result parsed = std::from_chars(it, end, literal);
+					// Only a number too large for T is an error, one too small rounds to 0
+					if (parsed.ec == std::errc::result_out_of_range) {
+						if (isUnderflow(std::string_view(it, parsed.ptr - it))) {
+							literal = 0;
+						} else {
+							fail(it - input.data(), "Number " + std::string(it, parsed.ptr) + " is out of range.");
+						}
+					}
+					it = parsed.ptr;
+					// Error checking for a stray decimal separator or an implicit multiplication
+					if (it[-1] == '.' || (it != end && *it == '.')) {
+						fail(it - input.data(), "Value following decimal separator is not a digit.");
+					} else if (it != end && std::isalpha((unsigned char)*it)) {
+						fail(it - input.data(), "Value following number is a letter. Multiplication must be explicit.");
 					}
-					i--;
 					tokens.push_back(Token::Literal);
-					literals.push_back(literalResult);
-					break;
+					literals.push_back(literal);
+				}
+				// Skip whitespace
+				else if (std::isspace((unsigned char)*it)) {
+					++it;
+				} else {
+					fail(start, std::string("Unexpected character ") + *it + ".");
 				}
 				break;
 			}
+			// A token starts at the character it was read from
+			positions.resize(tokens.size(), start);
+		}
+	}
+
+	// Compile the tokens into the program
+	template <typename T>
+	void Expression<T>::compile() {
+		// Initialize all indices to zero
+		indexLit = 0;
+		indexStr = 0;
+		indexTok = 0;
+		// Nothing to parse if tokenizing failed
+		if (!problem.ok()) {
+			return;
+		}
+		building = std::make_shared<Program>();
+		building->accuracy = accuracy;
+		// Parse once, emitting instructions instead of evaluating
+		building->result = parseExpression();
+		// Every token must have been consumed
+		if (problem.ok() && indexTok < tokens.size()) {
+			fail(tokenPosition(), "Unexpected token after the end of the expression.");
+		}
+		// Whatever was emitted before the problem is discarded
+		if (!problem.ok()) {
+			return;
+		}
+		optimize();
+		compileNative(*building);
+		program = building;
+	}
+
+	// Append the derivative of an instruction
+	// Operands with a derivative of zero add nothing, so only what can change gets an instruction
+	template <typename T>
+	void Expression<T>::differentiate(std::vector<Instruction>& instructions, Accuracy accuracy, int r, std::vector<int>& d, std::vector<PendingProduct>& pending) {
+		d.resize(instructions.size(), -1);
+		Instruction ins = instructions[r];
+		int a = ins.a;
+		int b = ins.b;
+		auto emit = [&](Op op, int a, int b) {
+			Instruction instruction{ op };
+			instruction.a = a;
+			instruction.b = b;
+			instructions.push_back(instruction);
+			return (int)instructions.size() - 1;
+		};
+		auto literal = [&](T value) {
+			Instruction instruction{ Op::Literal };
+			instruction.value = value;
+			instructions.push_back(instruction);
+			return (int)instructions.size() - 1;
+		};
+		// Calls have the accuracy of the program
+		auto callOf = [&](Function function, int a) {
+			instructions.push_back(call(function, accuracy, a));
+			return (int)instructions.size() - 1;
+		};
+		// Sum, difference and product where -1 stands for a derivative of zero
+		auto add = [&](int a, int b) {
+			return a < 0 ? b : b < 0 ? a : emit(Op::Add, a, b);
+		};
+		auto subtract = [&](int a, int b) {
+			return b < 0 ? a : a < 0 ? emit(Op::Negate, b, 0) : emit(Op::Subtract, a, b);
+		};
+		auto multiply = [&](int a, int b) {
+			return a < 0 || b < 0 ? -1 : emit(Op::Multiply, a, b);
+		};
+		switch (ins.op) {
+		case Op::Literal:
+		case Op::Variable:
+			break;
+		case Op::Negate:
+			d[r] = d[a] < 0 ? -1 : emit(Op::Negate, d[a], 0);
+			break;
+		case Op::Add:
+			d[r] = add(d[a], d[b]);
+			break;
+		case Op::Subtract:
+			d[r] = subtract(d[a], d[b]);
+			break;
+		case Op::Multiply:
+			// (a * b)' = a' * b + a * b'
+			d[r] = add(multiply(d[a], b), multiply(a, d[b]));
+			break;
+		case Op::Divide: {
+			// (a / b)' = (a' - (a / b) * b') / b
+			int numerator = subtract(d[a], multiply(r, d[b]));
+			d[r] = numerator < 0 ? -1 : emit(Op::Divide, numerator, b);
+			break;
+		}
+		case Op::Pow:
+			if (d[b] < 0) {
+				// (a ^ c)' = c * a ^ (c - 1) * a', which the optimizer turns back into multiplications for whole c
+				d[r] = multiply(emit(Op::Multiply, b, emit(Op::Pow, a, emit(Op::Subtract, b, literal(1)))), d[a]);
+			} else {
+				// (a ^ b)' = a ^ b * (b' * log(a) + b * a' / a)
+				int viaBase = d[a] < 0 ? -1 : emit(Op::Divide, emit(Op::Multiply, b, d[a]), a);
+				d[r] = emit(Op::Multiply, r, add(multiply(d[b], callOf(Function::Log, a)), viaBase));
+			}
+			break;
+		case Op::Call: {
+			if (d[a] < 0) {
+				break;
+			}
+			switch (ins.function) {
+			case Function::Sin:
+				d[r] = emit(Op::Multiply, callOf(Function::Cos, a), d[a]);
+				break;
+			case Function::Cos:
+				d[r] = emit(Op::Negate, emit(Op::Multiply, callOf(Function::Sin, a), d[a]), 0);
+				break;
+			case Function::Tan:
+				d[r] = emit(Op::Multiply, emit(Op::Add, literal(1), emit(Op::Multiply, r, r)), d[a]);
+				break;
+			case Function::Exp:
+				d[r] = emit(Op::Multiply, r, d[a]);
+				break;
+			case Function::Log:
+				d[r] = emit(Op::Divide, d[a], a);
+				break;
+			case Function::Sqrt:
+				d[r] = emit(Op::Divide, d[a], emit(Op::Multiply, literal(2), r));
+				break;
+			case Function::Abs:
+				// |a|' = a' * a / |a|, which is not a number at zero
+				d[r] = emit(Op::Divide, emit(Op::Multiply, d[a], a), r);
+				break;
+			default:
+				d[r] = literal(std::numeric_limits<T>::quiet_NaN());
+				break;
+			}
+			break;
+		}
+		case Op::Min:
+		case Op::Max:
+			// The derivative of the operand picked, (a - b) * [b < a] moves from a to b
+			if (d[a] >= 0 || d[b] >= 0) {
+				int picksB = ins.op == Op::Min ? emit(Op::Less, b, a) : emit(Op::Less, a, b);
+				d[r] = add(d[a], multiply(subtract(d[b], d[a]), picksB));
+			}
+			break;
+		case Op::Atan2: {
+			// atan2(a, b)' = (b * a' - a * b') / (a^2 + b^2)
+			int numerator = subtract(multiply(b, d[a]), multiply(a, d[b]));
+			d[r] = numerator < 0 ? -1 : emit(Op::Divide, numerator, emit(Op::Add, emit(Op::Multiply, a, a), emit(Op::Multiply, b, b)));
+			break;
+		}
+		case Op::Sum:
+			// Summed alongside in the same loop
+			d[r] = d[b] < 0 ? -1 : emit(Op::Sum, a, d[b]);
+			break;
+		case Op::Product:
+			if (d[b] >= 0) {
+				pending.push_back({ a, r, emit(Op::Sum, a, emit(Op::Divide, d[b], b)) });
+			}
+			break;
+		case Op::Next:
+			for (const PendingProduct& product : pending) {
+				if (product.loop == a) {
+					d[product.product] = emit(Op::Multiply, product.product, product.logarithmic);
+				}
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Differentiate expression symbolically along a variable
+	// Forward mode over the program: every instruction gets a register holding its derivative, or none where the
+	// derivative is known to be zero. The program is copied with the derivative of each instruction right after it,
+	// so derivatives of a loop body run inside the loop, and the optimizer then folds, simplifies and drops whatever
+	// the derivative does not use
+	template <typename T>
+	Expression<T> Expression<T>::derivative(const std::string& name) const {
+		Expression<T> result;
+		result.jit = jit;
+		result.accuracy = program->accuracy;
+		result.variables = variables;
+		result.expressionString = "d/d" + name + "(" + expressionString + ")";
+		result.slotBound.assign(program->slotNames.size(), false);
+		result.mapContext = result.makeContext();
+		// An expression that failed to compile has no derivative
+		if (program->instructions.empty()) {
+			return result;
+		}
+		// The derivative of a cached program is cached under the key of the program, with a prefix no expression can start with
+		std::string key;
+		if (!cacheKey.empty()) {
+			key = cacheKey.substr(0, 2) + "#d/d" + name + "(" + cacheKey.substr(2) + ")";
+			std::shared_ptr<const Program> cached = cacheFind(key);
+			if (cached != nullptr) {
+				result.program = withDefaults(cached, program->slotDefaults);
+				result.cacheKey = key;
+				result.mapContext = result.makeContext();
+				return result;
+			}
+		}
+		int slot = find(name);
+		result.building = std::make_shared<Program>(*program);
+		Program& derived = *result.building;
+		derived.native.reset();
+		derived.scalarKernel = nullptr;
+		derived.batchKernel = nullptr;
+		std::vector<Instruction>& instructions = derived.instructions;
+		instructions.clear();
+		auto literal = [&](T value) {
+			Instruction instruction{ Op::Literal };
+			instruction.value = value;
+			instructions.push_back(instruction);
+			return (int)instructions.size() - 1;
+		};
+		size_t count = program->instructions.size();
+		// Register of each instruction in the copy, and the derivative of each register of the copy
+		std::vector<int> moved(count);
+		std::vector<int> d;
+		std::vector<PendingProduct> pending;
+		for (size_t i = 0; i < count; i++) {
+			Instruction ins = program->instructions[i];
+			int operands = arity(ins.op);
+			if (operands > 0) {
+				ins.a = moved[ins.a];
+			}
+			if (operands > 1) {
+				ins.b = moved[ins.b];
+			}
+			instructions.push_back(ins);
+			int r = moved[i] = (int)instructions.size() - 1;
+			d.resize(instructions.size(), -1);
+			if (ins.op == Op::Variable && ins.a == slot) {
+				d[r] = literal(1);
+			} else {
+				differentiate(instructions, program->accuracy, r, d, pending);
+			}
+		}
+		int derivedResult = d[moved[program->result]];
+		derived.result = derivedResult < 0 ? literal(0) : derivedResult;
+		result.optimize();
+		result.compileNative(derived);
+		result.program = result.building;
+		result.building.reset();
+		result.mapContext = result.makeContext();
+		if (!key.empty()) {
+			cacheStore(key, result.program);
+			result.cacheKey = key;
 		}
+		return result;
 	}
 
 	// Set the expression
 	template <typename T>
-	void Expression<T>::set(std::string expression) {
-		// Clear
+	void Expression<T>::set(std::string_view expression) {
+		// Clear, keeping the capacity of the token buffers
+		if (names.size() > maxNames) {
+			names.clear();
+			nameIndices.clear();
+		}
 		strings.clear();
 		tokens.clear();
 		literals.clear();
+		positions.clear();
+		problem = Diagnostic();
+		program = emptyProgram();
 		// Get string
-		expressionString = expression;
-		// Remove all white space
-		expressionString.erase(remove_if(expressionString.begin(), expressionString.end(), isspace), expressionString.end());
-		// Make lowercase
-		std::transform(expressionString.begin(), expressionString.end(), expressionString.begin(), ::tolower);
-		// Tokenize
-		try {
-			tokenize(expressionString);
-		} catch (std::exception& e) {
-			std::cout << e.what() << "\n";
+		expressionString.assign(expression.data(), expression.size());
+		// Programs read constants as literals, so only cache them while no variable changes a constant
+		cacheKey.clear();
+		bool constantsKept = true;
+		for (size_t i = 0; i < builtinCount && !variables.empty(); i++) {
+			if (builtins[i].kind == Kind::Constant) {
+				typename std::unordered_map<std::string, T>::iterator iterV = variables.find(std::string(builtins[i].name));
+				constantsKept = constantsKept && (iterV == variables.end() || iterV->second == T(builtins[i].value));
+			}
 		}
+		if (constantsKept) {
+			cacheKey = cachePrefix();
+			normalize(expression, cacheKey);
+		}
+		std::shared_ptr<const Program> cached = cacheKey.empty() ? nullptr : cacheFind(cacheKey);
+		if (cached != nullptr) {
+			// Start each variable from its current value in the map like a fresh compile would
+			std::vector<T> defaults(cached->slotNames.size(), 0);
+			for (size_t i = 0; i < defaults.size(); i++) {
+				typename std::unordered_map<std::string, T>::iterator iterV = variables.find(cached->slotNames[i]);
+				if (iterV != variables.end()) {
+					defaults[i] = iterV->second;
+				}
+			}
+			program = withDefaults(cached, defaults);
+		} else {
+			// Tokenize and compile, whitespace and case are handled by tokenize()
+			// Neither throws, a problem is left in the diagnostic and the program stays empty
+			tokenize(expression);
+			compile();
+			if (!problem.ok()) {
+				cacheKey.clear();
+			} else if (!cacheKey.empty()) {
+				cacheStore(cacheKey, program);
+			}
+		}
+		building.reset();
+		slotBound.assign(program->slotNames.size(), false);
+		mapContext = makeContext();
+	}
+
+	// Get the problem found when the expression was last set
+	template <typename T>
+	const typename Expression<T>::Diagnostic& Expression<T>::diagnostic() const {
+		return problem;
+	}
+
+	// Check if the expression runs as native code
+	template <typename T>
+	bool Expression<T>::isNative() const {
+		return program->native != nullptr;
 	}
 
-	// Solve expression
+	// Resolve a variable name to its slot
+	template <typename T>
+	typename Expression<T>::Slot Expression<T>::bind(const std::string& name) {
+		int slot = find(name);
+		if (slot >= 0 && (size_t)slot < slotBound.size()) {
+			slotBound[slot] = true;
+		}
+		return slot;
+	}
+
+	// Create a context for this expression
+	template <typename T>
+	typename Expression<T>::Context Expression<T>::makeContext() const {
+		Context context;
+		context.slots = program->slotDefaults;
+		prepare(*program, context);
+		return context;
+	}
+
+	// Get the size of the compiled program
+	template <typename T>
+	typename Expression<T>::Stats Expression<T>::stats() const {
+		return program->stats;
+	}
+
+	// Solve expression reading variables from the map
 	template <typename T>
 	T Expression<T>::solve() {
-		// Initialize all indices to zero
-		indexLit = 0;
-		indexStr = 0;
-		indexTok = 0;
-		// Begin parsing
-		T result = 0;
-		try {
-			result = parseExpression();
-		} catch (std::runtime_error& e) {
-			std::cout << e.what() << "\n";
+		// Copy each variable into its slot
+		const std::vector<std::string>& slotNames = program->slotNames;
+		for (size_t i = 0; i < slotNames.size(); i++) {
+			typename std::unordered_map<std::string, T>::iterator iterV = variables.find(slotNames[i]);
+			if (iterV == variables.end()) {
+				// Map has variables but this one wasn't provided
+				return std::numeric_limits<T>::quiet_NaN();
+			}
+			mapContext.slots[i] = iterV->second;
 		}
-		return result;
+		return solve(mapContext);
+	}
+
+	// Solve expression reading variables from the slots of the context
+	template <typename T>
+	T Expression<T>::solve(Context& context) const {
+		const std::vector<Instruction>& instructions = program->instructions;
+		// An expression that failed to compile solves to NaN
+		if (instructions.empty()) {
+			return std::numeric_limits<T>::quiet_NaN();
+		}
+		// Native code performs the same operations as the interpreter below
+		prepare(*program, context);
+		if (program->scalarKernel != nullptr) {
+			prepareNative(*program, context, context.slots, nullptr, nullptr, 0);
+			T result;
+			void* out = &result;
+			program->scalarKernel(context.nativeRegisters.data(), (const void* const*)context.nativeSlots.data(), &out, sizeof(T));
+			return result;
+		}
+		// Run each instruction in order, storing its result in the matching register
+		const T* slots = context.slots.data();
+		T* r = context.registers.data();
+		for (size_t i = 0; i < instructions.size(); i++) {
+			const Instruction& ins = instructions[i];
+			switch (ins.op) {
+			case Op::Literal:
+				r[i] = ins.value;
+				break;
+			case Op::Variable:
+				r[i] = slots[ins.a];
+				break;
+			case Op::Negate:
+				r[i] = -r[ins.a];
+				break;
+			case Op::Add:
+				r[i] = r[ins.a] + r[ins.b];
+				break;
+			case Op::Subtract:
+				r[i] = r[ins.a] - r[ins.b];
+				break;
+			case Op::Multiply:
+				r[i] = r[ins.a] * r[ins.b];
+				break;
+			case Op::Divide:
+				r[i] = r[ins.a] / r[ins.b];
+				break;
+			case Op::Pow:
+				r[i] = std::pow(r[ins.a], r[ins.b]);
+				break;
+			case Op::Call:
+				r[i] = ins.fn(r[ins.a]);
+				break;
+			case Op::Min:
+				r[i] = minimum(r[ins.a], r[ins.b]);
+				break;
+			case Op::Max:
+				r[i] = maximum(r[ins.a], r[ins.b]);
+				break;
+			case Op::Atan2:
+				r[i] = arctangent(r[ins.a], r[ins.b]);
+				break;
+			case Op::Less:
+				r[i] = less(r[ins.a], r[ins.b]);
+				break;
+			case Op::Loop:
+				r[i] = loopStart(r[ins.a], r[ins.b]);
+				break;
+			case Op::Sum:
+			case Op::Product: {
+				const Instruction& loop = instructions[ins.a];
+				r[i] = accumulate(ins.op, r[i], r[ins.b], r[ins.a], r[loop.a], r[loop.b]);
+				break;
+			}
+			case Op::Next:
+				// Count and go back to the start of the body
+				r[i] = 0;
+				if (loopAgain(r[ins.a], r[instructions[ins.a].b])) {
+					r[ins.a] += 1;
+					i = ins.a;
+				}
+				break;
+			}
+		}
+		return r[program->result];
 	};
 
-	// Check if the function is valid
+	// Solve a program for n samples
+	// Each instruction runs over BatchWidth lanes in a fixed length loop, which the compiler turns into
+	// SSE/AVX/NEON packed arithmetic. The lanes perform the same operations in the same order as
+	// solve(), and functions call the same routines, so results are identical to the scalar path
 	template <typename T>
-	bool Expression<T>::isValid() {
-		indexLit = 0;
-		indexStr = 0;
-		indexTok = 0;
-		// Begin parsing
-		T result = 0;
-		try {
-			result = parseExpression();
-		} catch (std::runtime_error& e) {
-			std::cout << e.what() << "\n";
-			return false;
+	void Expression<T>::runBatch(const Program& program, Context& context, const std::vector<T>& slots, const Slot* inputs, const T* const* columns, int columnCount, T* out, size_t n) {
+		const std::vector<Instruction>& instructions = program.instructions;
+		// Native code runs the same operations a whole SSE register of lanes at a time
+		if (program.batchKernel != nullptr) {
+			runNative(program, context, slots, inputs, columns, columnCount, &out, n);
+			return;
+		}
+		std::vector<T>& batchRegisters = context.batchRegisters;
+		std::vector<const T*>& batchColumns = context.batchColumns;
+		batchRegisters.resize(instructions.size() * BatchWidth);
+		batchColumns.assign(slots.size(), nullptr);
+		for (int c = 0; c < columnCount; c++) {
+			batchColumns[inputs[c]] = columns[c];
+		}
+		// Evaluate in blocks of BatchWidth samples, the last block is padded
+		for (size_t start = 0; start < n; start += BatchWidth) {
+			size_t lanes = std::min(n - start, (size_t)BatchWidth);
+			for (size_t i = 0; i < instructions.size(); i++) {
+				const Instruction& ins = instructions[i];
+				T* r = &batchRegisters[i * BatchWidth];
+				const T* a = &batchRegisters[ins.a * BatchWidth];
+				const T* b = &batchRegisters[ins.b * BatchWidth];
+				switch (ins.op) {
+				case Op::Literal:
+					std::fill(r, r + BatchWidth, ins.value);
+					break;
+				case Op::Variable:
+					if (batchColumns[ins.a] != nullptr) {
+						std::copy(batchColumns[ins.a] + start, batchColumns[ins.a] + start + lanes, r);
+						std::fill(r + lanes, r + BatchWidth, T(0));
+					} else {
+						std::fill(r, r + BatchWidth, slots[ins.a]);
+					}
+					break;
+				case Op::Negate:
+					for (int k = 0; k < BatchWidth; k++) r[k] = -a[k];
+					break;
+				case Op::Add:
+					for (int k = 0; k < BatchWidth; k++) r[k] = a[k] + b[k];
+					break;
+				case Op::Subtract:
+					for (int k = 0; k < BatchWidth; k++) r[k] = a[k] - b[k];
+					break;
+				case Op::Multiply:
+					for (int k = 0; k < BatchWidth; k++) r[k] = a[k] * b[k];
+					break;
+				case Op::Divide:
+					for (int k = 0; k < BatchWidth; k++) r[k] = a[k] / b[k];
+					break;
+				case Op::Pow:
+					for (int k = 0; k < BatchWidth; k++) r[k] = std::pow(a[k], b[k]);
+					break;
+				case Op::Call:
+					if (ins.batch != nullptr) {
+						ins.batch(a, r, BatchWidth);
+					} else {
+						for (int k = 0; k < BatchWidth; k++) {
+							r[k] = ins.fn(a[k]);
+						}
+					}
+					break;
+				case Op::Min:
+					for (int k = 0; k < BatchWidth; k++) r[k] = minimum(a[k], b[k]);
+					break;
+				case Op::Max:
+					for (int k = 0; k < BatchWidth; k++) r[k] = maximum(a[k], b[k]);
+					break;
+				case Op::Atan2:
+					for (int k = 0; k < BatchWidth; k++) r[k] = arctangent(a[k], b[k]);
+					break;
+				case Op::Less:
+					for (int k = 0; k < BatchWidth; k++) r[k] = less(a[k], b[k]);
+					break;
+				case Op::Loop:
+					for (int k = 0; k < BatchWidth; k++) r[k] = loopStart(a[k], b[k]);
+					break;
+				case Op::Sum:
+				case Op::Product: {
+					const T* first = &batchRegisters[instructions[ins.a].a * BatchWidth];
+					const T* last = &batchRegisters[instructions[ins.a].b * BatchWidth];
+					// Usually every lane is past its first pass and not yet done, then the term is simply added or multiplied
+					// in. Counting those lanes and folding them all at once vectorizes where the general case does not
+					int steady = 0;
+					for (int k = 0; k < BatchWidth; k++) steady += (a[k] > first[k]) & (a[k] <= last[k]);
+					if (steady == BatchWidth && ins.op == Op::Sum) {
+						for (int k = 0; k < BatchWidth; k++) r[k] += b[k];
+					} else if (steady == BatchWidth) {
+						for (int k = 0; k < BatchWidth; k++) r[k] *= b[k];
+					} else {
+						for (int k = 0; k < BatchWidth; k++) r[k] = accumulate(ins.op, r[k], b[k], a[k], first[k], last[k]);
+					}
+					break;
+				}
+				case Op::Next: {
+					// Every lane makes as many passes as the one making the most, the others keep their sums
+					T* counter = &batchRegisters[ins.a * BatchWidth];
+					const T* last = &batchRegisters[instructions[ins.a].b * BatchWidth];
+					std::fill(r, r + BatchWidth, T(0));
+					bool again = false;
+					for (size_t k = 0; k < lanes; k++) {
+						again = again || loopAgain(counter[k], last[k]);
+					}
+					if (again) {
+						for (int k = 0; k < BatchWidth; k++) counter[k] += 1;
+						i = ins.a;
+					}
+					break;
+				}
+				}
+			}
+			const T* result = &batchRegisters[program.result * BatchWidth];
+			std::copy(result, result + lanes, out + start);
+		}
+	}
+
+	// Solve expression for n samples at once
+	template <typename T>
+	void Expression<T>::solveBatch(Context& context, const Slot* inputs, const T* const* columns, int columnCount, T* out, size_t n) const {
+		// An expression that failed to compile solves to NaN
+		if (program->instructions.empty()) {
+			std::fill(out, out + n, std::numeric_limits<T>::quiet_NaN());
+			return;
+		}
+		prepare(*program, context);
+		runBatch(*program, context, context.slots, inputs, columns, columnCount, out, n);
+	}
+
+	// Solve expression for n samples of x and y at once
+	template <typename T>
+	void Expression<T>::solveBatch(Context& context, const T* x, const T* y, T* out, size_t n) const {
+		Slot inputs[2] = { find("x"), find("y") };
+		const T* columns[2] = { x, y };
+		solveBatch(context, inputs, columns, 2, out, n);
+	}
+
+	// Partial derivatives of an instruction along its operands
+	template <typename T>
+	void Expression<T>::partials(const Instruction& instruction, T r, T a, T b, T& pa, T& pb) {
+		pa = 0;
+		pb = 0;
+		switch (instruction.op) {
+		case Op::Negate:
+			pa = -1;
+			return;
+		case Op::Add:
+			pa = 1;
+			pb = 1;
+			return;
+		case Op::Subtract:
+			pa = 1;
+			pb = -1;
+			return;
+		case Op::Multiply:
+			pa = b;
+			pb = a;
+			return;
+		case Op::Divide:
+			pa = 1 / b;
+			pb = -r / b;
+			return;
+		case Op::Pow:
+			pa = a != 0 ? b * r / a : b * std::pow(a, b - 1);
+			pb = r * std::log(a);
+			return;
+		case Op::Min:
+			// Along the operand picked
+			if (b < a || std::isnan(b)) {
+				pb = 1;
+			} else {
+				pa = 1;
+			}
+			return;
+		case Op::Max:
+			if (a < b || std::isnan(b)) {
+				pb = 1;
+			} else {
+				pa = 1;
+			}
+			return;
+		case Op::Atan2: {
+			T norm = a * a + b * b;
+			pa = b / norm;
+			pb = -a / norm;
+			return;
+		}
+		case Op::Call:
+			break;
+		default:
+			return;
+		}
+		switch (instruction.function) {
+		case Function::Sin:
+			pa = std::cos(a);
+			break;
+		case Function::Cos:
+			pa = -std::sin(a);
+			break;
+		case Function::Tan:
+			pa = 1 + r * r;
+			break;
+		case Function::Abs:
+			pa = a > 0 ? T(1) : a < 0 ? T(-1) : T(0);
+			break;
+		case Function::Exp:
+			pa = r;
+			break;
+		case Function::Log:
+			pa = 1 / a;
+			break;
+		case Function::Sqrt:
+			pa = 1 / (2 * r);
+			break;
+		default:
+			pa = std::numeric_limits<T>::quiet_NaN();
+			break;
+		}
+	}
+
+	// Derivative of an instruction from the values and derivatives of its operands
+	// An operand that does not change adds nothing, even where its partial is infinite or not a number
+	template <typename T>
+	T Expression<T>::applyDerivative(const Instruction& instruction, T r, T a, T b, T da, T db) {
+		T pa, pb;
+		partials(instruction, r, a, b, pa, pb);
+		return (da != 0 ? pa * da : T(0)) + (db != 0 ? pb * db : T(0));
+	}
+
+	// Solve a program with native code for n samples
+	// Whole SSE registers of lanes run first, then the remainder one at a time
+	template <typename T>
+	void Expression<T>::runNative(const Program& program, Context& context, const std::vector<T>& slots, const Slot* inputs, const T* const* columns, int columnCount, T* const* out, size_t n) {
+		prepareNative(program, context, slots, inputs, columns, columnCount);
+		std::vector<const T*>& nativeSlots = context.nativeSlots;
+		std::vector<T*>& nativeOutputs = context.nativeOutputs;
+		size_t packed = n - n % (16 / sizeof(T));
+		program.batchKernel(context.nativeRegisters.data(), (const void* const*)nativeSlots.data(), (void* const*)out, packed * sizeof(T));
+		for (int c = 0; c < columnCount; c++) {
+			nativeSlots[inputs[c] * 2] = columns[c] + packed;
+		}
+		nativeOutputs.resize(program.outputs.size() + 1);
+		for (size_t k = 0; k < nativeOutputs.size(); k++) {
+			nativeOutputs[k] = out[k] + packed;
+		}
+		program.scalarKernel(context.nativeRegisters.data(), (const void* const*)nativeSlots.data(), (void* const*)nativeOutputs.data(), (n - packed) * sizeof(T));
+	}
+
+	// Solve a program and its derivatives along x and y for n samples
+	// Every instruction carries a value and two derivatives over BatchWidth lanes, the values are computed exactly as runBatch() does
+	template <typename T>
+	void Expression<T>::runGradient(const Program& program, Context& context, const std::vector<T>& slots, const std::vector<T>& seeds, const Slot* inputs, const T* const* columns, const T* const* dxColumns, int columnCount, T* out, T* dx, T* dy, size_t n) {
+		const std::vector<Instruction>& instructions = program.instructions;
+		std::vector<T>& gradientRegisters = context.gradientRegisters;
+		std::vector<const T*>& batchColumns = context.batchColumns;
+		gradientRegisters.resize(instructions.size() * 3 * BatchWidth);
+		batchColumns.assign(slots.size() * 2, nullptr);
+		// Each slot has a column of values and a column of derivatives along x, either may be null
+		for (int c = 0; c < columnCount; c++) {
+			batchColumns[inputs[c] * 2] = columns[c];
+			batchColumns[inputs[c] * 2 + 1] = dxColumns != nullptr ? dxColumns[c] : nullptr;
+		}
+		for (size_t start = 0; start < n; start += BatchWidth) {
+			size_t lanes = std::min(n - start, (size_t)BatchWidth);
+			for (size_t i = 0; i < instructions.size(); i++) {
+				const Instruction& ins = instructions[i];
+				T* r = &gradientRegisters[i * 3 * BatchWidth];
+				T* rx = r + BatchWidth;
+				T* ry = rx + BatchWidth;
+				const T* a = &gradientRegisters[ins.a * 3 * BatchWidth];
+				const T* ax = a + BatchWidth;
+				const T* ay = ax + BatchWidth;
+				const T* b = &gradientRegisters[ins.b * 3 * BatchWidth];
+				const T* bx = b + BatchWidth;
+				const T* by = bx + BatchWidth;
+				switch (ins.op) {
+				case Op::Literal:
+					std::fill(r, r + BatchWidth, ins.value);
+					std::fill(rx, rx + 2 * BatchWidth, T(0));
+					break;
+				case Op::Variable: {
+					const T* column = batchColumns[ins.a * 2];
+					const T* dxColumn = batchColumns[ins.a * 2 + 1];
+					if (column != nullptr) {
+						std::copy(column + start, column + start + lanes, r);
+						std::fill(r + lanes, r + BatchWidth, T(0));
+					} else {
+						std::fill(r, r + BatchWidth, slots[ins.a]);
+					}
+					if (dxColumn != nullptr) {
+						std::copy(dxColumn + start, dxColumn + start + lanes, rx);
+						std::fill(rx + lanes, rx + BatchWidth, T(0));
+					} else {
+						std::fill(rx, rx + BatchWidth, seeds[ins.a * 2]);
+					}
+					std::fill(ry, ry + BatchWidth, seeds[ins.a * 2 + 1]);
+					break;
+				}
+				case Op::Negate:
+					for (int k = 0; k < BatchWidth; k++) {
+						r[k] = -a[k];
+						rx[k] = -ax[k];
+						ry[k] = -ay[k];
+					}
+					break;
+				case Op::Add:
+					for (int k = 0; k < BatchWidth; k++) {
+						r[k] = a[k] + b[k];
+						rx[k] = ax[k] + bx[k];
+						ry[k] = ay[k] + by[k];
+					}
+					break;
+				case Op::Subtract:
+					for (int k = 0; k < BatchWidth; k++) {
+						r[k] = a[k] - b[k];
+						rx[k] = ax[k] - bx[k];
+						ry[k] = ay[k] - by[k];
+					}
+					break;
+				case Op::Multiply:
+					for (int k = 0; k < BatchWidth; k++) {
+						r[k] = a[k] * b[k];
+						rx[k] = ax[k] * b[k] + a[k] * bx[k];
+						ry[k] = ay[k] * b[k] + a[k] * by[k];
+					}
+					break;
+				case Op::Divide:
+					for (int k = 0; k < BatchWidth; k++) {
+						r[k] = a[k] / b[k];
+						rx[k] = (ax[k] - r[k] * bx[k]) / b[k];
+						ry[k] = (ay[k] - r[k] * by[k]) / b[k];
+					}
+					break;
+				case Op::Pow:
+				case Op::Call:
+				case Op::Min:
+				case Op::Max:
+				case Op::Atan2:
+				case Op::Less:
+					if (ins.op == Op::Call && ins.batch != nullptr) {
+						ins.batch(a, r, BatchWidth);
+					}
+					for (int k = 0; k < BatchWidth; k++) {
+						if (ins.op != Op::Call) {
+							r[k] = apply(ins, a[k], b[k]);
+						} else if (ins.batch == nullptr) {
+							r[k] = ins.fn(a[k]);
+						}
+						T pa, pb;
+						partials(ins, r[k], a[k], b[k], pa, pb);
+						rx[k] = (ax[k] != 0 ? pa * ax[k] : T(0)) + (bx[k] != 0 ? pb * bx[k] : T(0));
+						ry[k] = (ay[k] != 0 ? pa * ay[k] : T(0)) + (by[k] != 0 ? pb * by[k] : T(0));
+					}
+					break;
+				case Op::Loop:
+					for (int k = 0; k < BatchWidth; k++) r[k] = loopStart(a[k], b[k]);
+					std::fill(rx, rx + 2 * BatchWidth, T(0));
+					break;
+				case Op::Sum:
+				case Op::Product: {
+					// Derivatives first, a product needs the value before this pass
+					const T* first = &gradientRegisters[instructions[ins.a].a * 3 * BatchWidth];
+					const T* last = &gradientRegisters[instructions[ins.a].b * 3 * BatchWidth];
+					for (int k = 0; k < BatchWidth; k++) {
+						rx[k] = accumulateDerivative(ins.op, r[k], b[k], rx[k], bx[k], a[k], first[k], last[k]);
+						ry[k] = accumulateDerivative(ins.op, r[k], b[k], ry[k], by[k], a[k], first[k], last[k]);
+						r[k] = accumulate(ins.op, r[k], b[k], a[k], first[k], last[k]);
+					}
+					break;
+				}
+				case Op::Next: {
+					T* counter = &gradientRegisters[ins.a * 3 * BatchWidth];
+					const T* last = &gradientRegisters[instructions[ins.a].b * 3 * BatchWidth];
+					std::fill(r, r + 3 * BatchWidth, T(0));
+					bool again = false;
+					for (size_t k = 0; k < lanes; k++) {
+						again = again || loopAgain(counter[k], last[k]);
+					}
+					if (again) {
+						for (int k = 0; k < BatchWidth; k++) counter[k] += 1;
+						i = ins.a;
+					}
+					break;
+				}
+				}
+			}
+			const T* result = &gradientRegisters[program.result * 3 * BatchWidth];
+			std::copy(result, result + lanes, out + start);
+			std::copy(result + BatchWidth, result + BatchWidth + lanes, dx + start);
+			std::copy(result + 2 * BatchWidth, result + 2 * BatchWidth + lanes, dy + start);
+		}
+	}
+
+	// Solve expression and its partial derivatives for n samples at once
+	template <typename T>
+	void Expression<T>::solveGradient(Context& context, Slot slotX, Slot slotY, const Slot* inputs, const T* const* columns, int columnCount, T* out, T* dx, T* dy, size_t n) const {
+		// An expression that failed to compile solves to NaN
+		if (program->instructions.empty()) {
+			std::fill(out, out + n, std::numeric_limits<T>::quiet_NaN());
+			std::fill(dx, dx + n, std::numeric_limits<T>::quiet_NaN());
+			std::fill(dy, dy + n, std::numeric_limits<T>::quiet_NaN());
+			return;
+		}
+		prepare(*program, context);
+		std::vector<T>& seeds = context.gradientSeeds;
+		seeds.assign(context.slots.size() * 2, 0);
+		seeds[slotX * 2] = 1;
+		seeds[slotY * 2 + 1] = 1;
+		runGradient(*program, context, context.slots, seeds, inputs, columns, nullptr, columnCount, out, dx, dy, n);
+	}
+
+	// Solve the instructions of a program that have the given dependence on the grid
+	template <typename T>
+	void Expression<T>::solvePart(const Program& program, const std::vector<unsigned char>& dependence, unsigned char part, const std::vector<T>& slots, T value, T* registers, T* derivatives) {
+		const std::vector<Instruction>& instructions = program.instructions;
+		for (size_t i = 0; i < instructions.size(); i++) {
+			if (dependence[i] != part) {
+				continue;
+			}
+			const Instruction& ins = instructions[i];
+			if (ins.op == Op::Variable) {
+				registers[i] = part == 0 ? slots[ins.a] : value;
+			} else {
+				registers[i] = apply(ins, registers[ins.a], registers[ins.b]);
+			}
+			if (derivatives != nullptr) {
+				if (ins.op == Op::Variable) {
+					derivatives[i] = part == 0 ? T(0) : T(1);
+				} else {
+					derivatives[i] = applyDerivative(ins, registers[i], registers[ins.a], registers[ins.b], derivatives[ins.a], derivatives[ins.b]);
+				}
+			}
+		}
+	}
+
+	// Split the expression over a grid of x and y
+	// Instructions depending on x but not y are solved once per column, those depending on y but not x once per row
+	// and those depending on neither once. The rest form a smaller program solved for every point, whose variables
+	// are the hoisted registers it reads. Every instruction still runs the same operation on the same operands,
+	// so the results are identical to solveBatch()
+	template <typename T>
+	typename Expression<T>::Grid Expression<T>::makeGrid(const Context& context, Slot slotX, const T* x, size_t width, Slot slotY) const {
+		Grid grid;
+		grid.source = program;
+		grid.width = width;
+		const std::vector<Instruction>& instructions = program->instructions;
+		std::shared_ptr<Program> point = std::make_shared<Program>();
+		grid.program = point;
+		if (instructions.empty()) {
+			return grid;
+		}
+		// Find what each instruction depends on
+		// Loops are solved for every point as a whole since solvePart() runs each instruction once, only the values
+		// they read are hoisted
+		std::vector<unsigned char>& dependence = grid.dependence;
+		dependence.resize(instructions.size());
+		int loops = 0;
+		for (size_t i = 0; i < instructions.size(); i++) {
+			const Instruction& ins = instructions[i];
+			int operands = arity(ins.op);
+			loops += ins.op == Op::Loop ? 1 : ins.op == Op::Next ? -1 : 0;
+			if ((loops > 0 || ins.op == Op::Next) && operands > 0) {
+				dependence[i] = 3;
+			} else if (ins.op == Op::Variable) {
+				dependence[i] = ins.a == slotX ? 1 : ins.a == slotY ? 2 : 0;
+			} else {
+				dependence[i] = (operands > 0 ? dependence[ins.a] : 0) | (operands > 1 ? dependence[ins.b] : 0);
+			}
+		}
+		// Build the point program, reading each hoisted register through a slot
+		std::vector<int> moved(instructions.size(), -1);
+		auto read = [&](int source) {
+			if (dependence[source] == 3) {
+				return moved[source];
+			}
+			if (moved[source] < 0) {
+				Instruction variable{ Op::Variable };
+				variable.a = (int)grid.hoisted.size();
+				grid.hoisted.push_back(source);
+				point->instructions.push_back(variable);
+				moved[source] = (int)point->instructions.size() - 1;
+			}
+			return moved[source];
+		};
+		for (size_t i = 0; i < instructions.size(); i++) {
+			if (dependence[i] != 3) {
+				continue;
+			}
+			Instruction ins = instructions[i];
+			int operands = arity(ins.op);
+			if (operands > 0) {
+				ins.a = read(ins.a);
+			}
+			if (operands > 1) {
+				ins.b = read(ins.b);
+			}
+			point->instructions.push_back(ins);
+			moved[i] = (int)point->instructions.size() - 1;
+		}
+		point->result = read(program->result);
+		point->slotNames.resize(grid.hoisted.size());
+		point->slotDefaults.resize(grid.hoisted.size());
+		point->accuracy = program->accuracy;
+		point->stats.instructions = (int)point->instructions.size();
+		compileNative(*point);
+		// Solve the constant part once, then the x part for every column
+		grid.registers.resize(instructions.size());
+		solvePart(*program, dependence, 0, context.slots, 0, grid.registers.data());
+		std::vector<T> registers = grid.registers;
+		std::vector<T> derivatives(instructions.size(), 0);
+		for (size_t k = 0; k < grid.hoisted.size(); k++) {
+			if (dependence[grid.hoisted[k]] == 1) {
+				grid.columnSlots.push_back((Slot)k);
+			}
+		}
+		grid.columns.resize(grid.columnSlots.size() * width);
+		grid.columnDerivatives.resize(grid.columns.size());
+		for (size_t j = 0; j < width; j++) {
+			solvePart(*program, dependence, 1, context.slots, x[j], registers.data(), derivatives.data());
+			for (size_t c = 0; c < grid.columnSlots.size(); c++) {
+				int source = grid.hoisted[grid.columnSlots[c]];
+				grid.columns[c * width + j] = registers[source];
+				grid.columnDerivatives[c * width + j] = derivatives[source];
+			}
+		}
+		// Where the point program runs natively, so does its gradient
+		if (point->batchKernel != nullptr) {
+			grid.gradient = makeGradient(*point, grid.hoisted, grid.dependence);
+			for (int offset : { 0, (int)grid.hoisted.size() }) {
+				for (Slot slot : grid.columnSlots) {
+					grid.gradientSlots.push_back(slot + offset);
+				}
+			}
+		}
+		return grid;
+	}
+
+	// Carry derivatives along x and y through the point program of a grid as dual numbers
+	// Each instruction is followed by the instructions of its two derivatives, from the same rules as derivative(),
+	// and repeats are merged, so native code solves the value and the gradient in one pass. The value runs exactly
+	// the instructions of the point program, nothing is rewritten
+	template <typename T>
+	std::shared_ptr<const typename Expression<T>::Program> Expression<T>::makeGradient(const Program& point, const std::vector<int>& hoisted, const std::vector<unsigned char>& dependence) const {
+		std::shared_ptr<Program> gradient = std::make_shared<Program>();
+		std::vector<Instruction> instructions;
+		size_t hoistedCount = hoisted.size();
+		std::vector<int> moved(point.instructions.size());
+		std::vector<int> dx;
+		std::vector<int> dy;
+		std::vector<PendingProduct> pending;
+		for (size_t i = 0; i < point.instructions.size(); i++) {
+			Instruction ins = point.instructions[i];
+			int operands = arity(ins.op);
+			if (operands > 0) {
+				ins.a = moved[ins.a];
+			}
+			if (operands > 1) {
+				ins.b = moved[ins.b];
+			}
+			instructions.push_back(ins);
+			int r = moved[i] = (int)instructions.size() - 1;
+			dx.resize(instructions.size(), -1);
+			dy.resize(instructions.size(), -1);
+			if (ins.op == Op::Variable) {
+				// A hoisted value changes along the one grid variable it depends on, its derivative is in the slot after the values
+				unsigned char part = dependence[hoisted[ins.a]];
+				if (part != 0) {
+					Instruction derivative{ Op::Variable };
+					derivative.a = (int)hoistedCount + ins.a;
+					instructions.push_back(derivative);
+					(part == 1 ? dx : dy)[r] = (int)instructions.size() - 1;
+				}
+			} else {
+				differentiate(instructions, point.accuracy, r, dx, pending);
+				dy.resize(instructions.size(), -1);
+				differentiate(instructions, point.accuracy, r, dy, pending);
+			}
+		}
+		dx.resize(instructions.size(), -1);
+		dy.resize(instructions.size(), -1);
+		// A derivative of zero reads a literal
+		int results[3] = { moved[point.result], dx[moved[point.result]], dy[moved[point.result]] };
+		for (int& result : results) {
+			if (result < 0) {
+				Instruction zero{ Op::Literal };
+				zero.value = 0;
+				instructions.push_back(zero);
+				result = (int)instructions.size() - 1;
+			}
+		}
+		// Merge repeats, sin' and cos' along x and y call the same function on the same operand
+		std::vector<Instruction>& merged = gradient->instructions;
+		std::vector<int> mergedOf(instructions.size());
+		std::unordered_map<Instruction, int, InstructionHash> pushed;
+		for (size_t i = 0; i < instructions.size(); i++) {
+			Instruction ins = instructions[i];
+			int operands = arity(ins.op);
+			if (operands > 0) {
+				ins.a = mergedOf[ins.a];
+			}
+			if (operands > 1) {
+				ins.b = mergedOf[ins.b];
+			}
+			std::pair<typename std::unordered_map<Instruction, int, InstructionHash>::iterator, bool> inserted = pushed.emplace(ins, (int)merged.size());
+			if (inserted.second) {
+				merged.push_back(ins);
+			}
+			mergedOf[i] = inserted.first->second;
+		}
+		gradient->result = mergedOf[results[0]];
+		gradient->outputs = { mergedOf[results[1]], mergedOf[results[2]] };
+		gradient->slotNames.resize(hoistedCount * 2);
+		gradient->slotDefaults.resize(hoistedCount * 2);
+		gradient->accuracy = point.accuracy;
+		gradient->stats.instructions = (int)merged.size();
+		compileNative(*gradient);
+		if (gradient->batchKernel == nullptr) {
+			return nullptr;
+		}
+		return gradient;
+	}
+
+	// Solve expression on rows of a grid
+	template <typename T>
+	void Expression<T>::solveGrid(Context& context, const Grid& grid, const T* y, size_t height, size_t first, size_t count, T* out, T* dx, T* dy) const {
+		const Program& source = *grid.source;
+		const Program& point = *grid.program;
+		bool gradient = dx != nullptr && dy != nullptr;
+		// An expression that failed to compile solves to NaN
+		if (source.instructions.empty()) {
+			std::fill(out, out + count * height, std::numeric_limits<T>::quiet_NaN());
+			if (gradient) {
+				std::fill(dx, dx + count * height, std::numeric_limits<T>::quiet_NaN());
+				std::fill(dy, dy + count * height, std::numeric_limits<T>::quiet_NaN());
+			}
+			return;
+		}
+		std::vector<T>& registers = context.registers;
+		registers = grid.registers;
+		std::vector<T>& gridSlots = context.gridSlots;
+		gridSlots.resize(grid.hoisted.size());
+		std::vector<const T*>& gridColumns = context.gridColumns;
+		gridColumns.resize(grid.columnSlots.size());
+		for (size_t c = 0; c < grid.columnSlots.size(); c++) {
+			gridColumns[c] = &grid.columns[c * grid.width + first];
+		}
+		if (!gradient) {
+			for (size_t i = 0; i < height; i++) {
+				// Solve the y part for this row, then hand the values the point program reads over to its slots
+				solvePart(source, grid.dependence, 2, context.slots, y[i], registers.data());
+				for (size_t k = 0; k < grid.hoisted.size(); k++) {
+					gridSlots[k] = registers[grid.hoisted[k]];
+				}
+				runBatch(point, context, gridSlots, grid.columnSlots.data(), gridColumns.data(), (int)gridColumns.size(), out + i * count, count);
+			}
+			return;
+		}
+		// Hoisted values that depend on x carry their derivative along x in a column, those that depend on y their derivative along y
+		std::vector<T>& derivatives = context.gridDerivatives;
+		derivatives.assign(source.instructions.size(), 0);
+		size_t columnCount = grid.columnSlots.size();
+		if (grid.gradient != nullptr) {
+			// Native code reads the derivatives through slots after the values
+			gridSlots.resize(grid.hoisted.size() * 2);
+			gridColumns.resize(columnCount * 2);
+			for (size_t c = 0; c < columnCount; c++) {
+				gridColumns[columnCount + c] = &grid.columnDerivatives[c * grid.width + first];
+			}
+			for (size_t i = 0; i < height; i++) {
+				solvePart(source, grid.dependence, 2, context.slots, y[i], registers.data(), derivatives.data());
+				for (size_t k = 0; k < grid.hoisted.size(); k++) {
+					gridSlots[k] = registers[grid.hoisted[k]];
+					gridSlots[grid.hoisted.size() + k] = grid.dependence[grid.hoisted[k]] == 2 ? derivatives[grid.hoisted[k]] : T(0);
+				}
+				T* outs[3] = { out + i * count, dx + i * count, dy + i * count };
+				runNative(*grid.gradient, context, gridSlots, grid.gradientSlots.data(), gridColumns.data(), (int)gridColumns.size(), outs, count);
+			}
+			return;
+		}
+		std::vector<T>& seeds = context.gradientSeeds;
+		seeds.assign(grid.hoisted.size() * 2, 0);
+		std::vector<const T*>& gradientColumns = context.gradientColumns;
+		gradientColumns.resize(columnCount);
+		for (size_t c = 0; c < columnCount; c++) {
+			gradientColumns[c] = &grid.columnDerivatives[c * grid.width + first];
+		}
+		for (size_t i = 0; i < height; i++) {
+			solvePart(source, grid.dependence, 2, context.slots, y[i], registers.data(), derivatives.data());
+			for (size_t k = 0; k < grid.hoisted.size(); k++) {
+				gridSlots[k] = registers[grid.hoisted[k]];
+				seeds[k * 2 + 1] = grid.dependence[grid.hoisted[k]] == 2 ? derivatives[grid.hoisted[k]] : T(0);
+			}
+			runGradient(point, context, gridSlots, seeds, grid.columnSlots.data(), gridColumns.data(), gradientColumns.data(), (int)columnCount,
+				out + i * count, dx + i * count, dy + i * count, count);
 		}
-		return true;;
+	}
+
+	// Bound expression over a box
+	template <typename T>
+	typename Expression<T>::Interval Expression<T>::solveInterval(Context& context, const Slot* inputs, const Interval* ranges, int count) const {
+		const std::vector<Instruction>& instructions = program->instructions;
+		// An expression that failed to compile solves to NaN
+		if (instructions.empty()) {
+			Interval unknown;
+			unknown.lo = unknown.hi = std::numeric_limits<T>::quiet_NaN();
+			return unknown;
+		}
+		prepare(*program, context);
+		std::vector<Interval>& r = context.intervalRegisters;
+		r.resize(instructions.size());
+		for (size_t i = 0; i < instructions.size(); i++) {
+			const Instruction& ins = instructions[i];
+			if (ins.op == Op::Variable) {
+				T value = context.slots[ins.a];
+				r[i] = { value, value };
+				for (int c = 0; c < count; c++) {
+					if (inputs[c] == ins.a) {
+						r[i] = ranges[c];
+					}
+				}
+			} else if (ins.op == Op::Multiply && ins.a == ins.b) {
+				// Square, which unlike a product of two ranges is never negative, nor 0 * inf
+				Interval a = r[ins.a];
+				Interval square = a;
+				if (!std::isnan(a.lo)) {
+					square.lo = std::min(a.lo * a.lo, a.hi * a.hi);
+					square.hi = std::max(a.lo * a.lo, a.hi * a.hi);
+					if (a.lo <= 0 && a.hi >= 0) {
+						square.lo = 0;
+					}
+				}
+				r[i] = square;
+			} else if (ins.op == Op::Sum && !std::isnan(r[ins.a].lo) && !std::isnan(r[ins.b].lo)) {
+				// Between the fewest and the most passes of the term, which number floor(last - first) + 1 give or
+				// take one for rounding, plus the rounding of adding up that many values
+				const Instruction& loop = instructions[ins.a];
+				Interval first = r[loop.a];
+				Interval last = r[loop.b];
+				Interval term = r[ins.b];
+				T fewest = std::max(T(0), std::floor(last.lo - first.hi));
+				T most = std::max(T(0), std::floor(last.hi - first.lo) + 2);
+				T error = most * most * std::numeric_limits<T>::epsilon() * std::max(std::abs(term.lo), std::abs(term.hi));
+				r[i].lo = std::min(fewest * term.lo, most * term.lo) - error;
+				r[i].hi = std::max(fewest * term.hi, most * term.hi) + error;
+				if (std::isnan(r[i].lo) || std::isnan(r[i].hi)) {
+					r[i].lo = r[i].hi = std::numeric_limits<T>::quiet_NaN();
+				}
+			} else {
+				r[i] = applyInterval(ins, program->accuracy, r[ins.a], r[ins.b]);
+			}
+		}
+		return r[program->result];
+	}
+
+	// Check the expression compiled and that every variable it reads is bound or in the map
+	template <typename T>
+	typename Expression<T>::Diagnostic Expression<T>::validate() const {
+		if (!problem.ok()) {
+			return problem;
+		}
+		Diagnostic result;
+		if (program->instructions.empty()) {
+			result.message = "Expression is empty.";
+			return result;
+		}
+		// Every variable the program reads must be bound or provided by the map
+		const std::vector<std::string>& slotNames = program->slotNames;
+		for (const Instruction& ins : program->instructions) {
+			if (ins.op == Op::Variable && !slotBound[ins.a] && variables.find(slotNames[ins.a]) == variables.end()) {
+				result.position = program->slotPositions[ins.a];
+				result.message = "Variable " + slotNames[ins.a] + " wasn't initialized.";
+				return result;
+			}
+		}
+		return result;
+	}
+
+	// Check if the function is valid
+	template <typename T>
+	bool Expression<T>::isValid() const {
+		return validate().ok();
 	}
 
 	// Constructor
@@ -324,11 +2547,11 @@ namespace ExprUtil {
 	// Constructor that sets expression
 	// e.g. ExprUtil::ExpressionFloat expr("x^2/sin(2*pi/y))-x/2");
 	template <typename T>
-	Expression<T>::Expression(std::string expression) {
+	Expression<T>::Expression(std::string_view expression) {
 		set(expression);
 	}
 
 	// Instantiation
 	template class Expression<float>;
 	template class Expression<double>;
-}
\ No newline at end of file
+}
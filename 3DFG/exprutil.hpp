@@ -3,15 +3,96 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <cctype>
+#include <cmath>
+#include <limits>
+#include <list>
 #include <sstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <unordered_map>
+#include <vector>
+// User
+#include "exprjit.hpp"
+#include "exprmath.hpp"
 
 namespace ExprUtil {
 
 	template <typename T>
 	class Expression {
+	public:
+		// Index of a variable in the slots of a context
+		typedef int Slot;
+		// Function of one value, and of n values at once
+		typedef T(*FnPtr)(T);
+		typedef void(*BatchFn)(const T* in, T* out, size_t n);
+		// Number of samples solveBatch() runs each instruction over at a time
+		static const int BatchWidth = 64;
+		// Most passes a sum or product makes, longer ones give NaN
+		static const int MaxPasses = 1 << 20;
+		// Range of values [lo, hi], both NaN if the value may not be a number
+		struct Interval {
+			T lo = 0;
+			T hi = 0;
+		};
+		// Mutable state of a single evaluation, one per thread
+		// e.g. Context ctx = myExpr.makeContext(); ctx.slots[myExpr.bind("x")] = 4; myExpr.solve(ctx);
+		struct Context {
+			// Values of the variables by slot
+			std::vector<T> slots;
+			// Registers holding the result of each instruction
+			std::vector<T> registers;
+			// Registers holding BatchWidth results of each instruction for solveBatch()
+			std::vector<T> batchRegisters;
+			// Columns feeding each slot during solveBatch() and solveGradient(), null if the slot value is broadcast
+			std::vector<const T*> batchColumns;
+			// Registers and the column and value of each slot for native code
+			std::vector<T> nativeRegisters;
+			std::vector<const T*> nativeSlots;
+			// Columns native code writes the remaining samples to
+			std::vector<T*> nativeOutputs;
+			// Values hoisted out of the current row and the columns of x during solveGrid()
+			std::vector<T> gridSlots;
+			std::vector<const T*> gridColumns;
+			// Registers holding the range of each instruction for solveInterval()
+			std::vector<Interval> intervalRegisters;
+			// Registers holding BatchWidth values and derivatives along x and y of each instruction for solveGradient()
+			std::vector<T> gradientRegisters;
+			// Derivatives of each slot along x and y, and the column of derivatives along x feeding each slot
+			std::vector<T> gradientSeeds;
+			std::vector<const T*> gradientColumns;
+			// Derivatives along y of the registers solved for the current row during solveGrid()
+			std::vector<T> gridDerivatives;
+		};
+		// Problem found while setting or validating an expression
+		struct Diagnostic {
+			// Offset into the expression string of the character at fault
+			size_t position = 0;
+			// Description of the problem, empty if there is none
+			std::string message;
+			// Whether there is no problem
+			bool ok() const;
+		};
+		// Size of the compiled program
+		struct Stats {
+			// Instructions run per solve
+			int instructions = 0;
+			// Repeated subexpressions merged into an earlier instruction
+			int deduplicated = 0;
+		};
+		// Counters of the cache of compiled programs shared by every expression of this type
+		struct CacheStats {
+			// Lookups that found a compiled program and lookups that had to compile
+			size_t hits = 0;
+			size_t misses = 0;
+			// Programs held, and the most it holds before dropping the least recently used
+			size_t size = 0;
+			size_t capacity = 64;
+		};
+
 	private:
 
 		// Holds possible tokens
@@ -24,72 +105,384 @@ namespace ExprUtil {
 			Pow,
 			OpenP,
 			ClosedP,
+			Comma,
 			String,
 			Literal
 		};
 
-		// Associate string with a function
-		typedef T(*FnPtr)(T);
-		std::unordered_map<std::string, FnPtr> funcMap{
-			{"sin", sin},
-			{"cos", cos},
-			{"tan", tan},
-			{"abs", abs},
-			{"exp", exp},
-			{"log", log},
-			{"sqrt", sqrt}
+		// Holds possible instructions of the compiled program
+		enum class Op {
+			Literal,
+			Variable,
+			Negate,
+			Add,
+			Subtract,
+			Multiply,
+			Divide,
+			Pow,
+			Call,
+			Min,
+			Max,
+			Atan2,
+			// 1 where a is less than b and 0 elsewhere, for derivatives of min and max
+			Less,
+			// Counter of a loop from a to b in steps of 1. The instructions up to the matching Next form the body,
+			// which runs once for every value of the counter
+			Loop,
+			// Sum or product of b over the passes of loop a, complete once the loop ends
+			Sum,
+			Product,
+			// End of loop a, going back to the body while the counter has not passed the end, its own value is 0
+			// Kept by the optimizer for as long as a sum or product of the loop is
+			Next
+		};
+
+		// Functions registered with define(), shared by every expression of this type
+		struct UserFunction {
+			FnPtr scalar = nullptr;
+			BatchFn batch = nullptr;
+		};
+		struct Registry {
+			std::mutex mutex;
+			std::unordered_map<std::string, UserFunction> functions;
 		};
+		static Registry& registry();
 
-		// Processed expression string
+		// A single instruction, its result is stored in the register matching its index
+		// Operands a and b refer to the registers of earlier instructions
+		struct Instruction {
+			Op op;
+			int a = 0;
+			int b = 0;
+			// Value of a literal
+			T value = 0;
+			// Function of a call, for a single value and for a batch of them at the accuracy of the program
+			Function function = Function::Sin;
+			FnPtr fn = nullptr;
+			BatchFn batch = nullptr;
+			// Same operation on the same operands
+			bool operator==(const Instruction& other) const;
+		};
+		// Hash of an instruction for finding repeated subexpressions
+		struct InstructionHash {
+			size_t operator()(const Instruction& instruction) const;
+		};
+
+		// Expression string as set
 		std::string expressionString;
 
+		// Lowercase identifiers seen by tokenize(), and the index of each in names
+		// Kept between expressions so a name seen before allocates nothing, and dropped by set() once there are more
+		// than maxNames so an expression that keeps being set to new names does not grow them for good
+		static const size_t maxNames = 1024;
+		std::vector<std::string> names;
+		std::unordered_map<std::string, int> nameIndices;
+		// Lowercase copy of the identifier being interned, reused between lookups
+		std::string lowered;
+
 		// Tokens
 		std::vector<Token> tokens;
-		int indexTok = 0;
+		size_t indexTok = 0;
 		std::vector<T> literals;
 		int indexLit = 0;
-		std::vector<std::string> strings;
+		// Index into names of each string token
+		std::vector<int> strings;
 		int indexStr = 0;
+		// Offset into the expression string of each token
+		std::vector<size_t> positions;
+
+		// Parentheses and function calls the parser is inside of
+		struct Frame {
+			// Size of the operator and operand stacks when the frame opened
+			size_t operators = 0;
+			size_t operands = 0;
+			// What closing the frame applies to the arguments: Literal for plain parentheses, Call for a function
+			// of one argument, Min, Max, Atan2, or Sum and Product over a loop
+			Op op = Op::Literal;
+			Instruction call{ Op::Call };
+			// Name of the function and where it appears, and the arguments seen so far
+			int name = 0;
+			size_t position = 0;
+			int arguments = 1;
+			// Name of the counter of a sum or product, and its loop once the bounds are parsed
+			int counter = 0;
+			int loop = -1;
+			// Negate the contents once the frame closes
+			bool negative = false;
+		};
+		// Stacks of the parser, kept between expressions like the tokens
+		std::vector<Frame> frames;
+		std::vector<Op> operators;
+		std::vector<int> operands;
+		// Counters of the sums and products being parsed, by name, innermost last
+		std::vector<std::pair<int, int>> counters;
+
+		// First problem found by tokenize() and compile()
+		Diagnostic problem;
+
+		// Compiled form of an expression, never modified once compiled so it can be shared between threads
+		struct Program {
+			// Instructions, empty if the expression failed to compile
+			std::vector<Instruction> instructions;
+			// Register holding the result
+			int result = 0;
+			// Registers native code writes out after the result, empty but for the gradient programs of grids
+			std::vector<int> outputs;
+			Stats stats;
+			// Accuracy of the functions the program calls
+			Accuracy accuracy = Accuracy::Exact;
+			// Names of the variables behind each slot, their value when compiled and where they first appear
+			std::vector<std::string> slotNames;
+			std::vector<T> slotDefaults;
+			std::vector<size_t> slotPositions;
+			// Native code for the instructions, null if the interpreter runs them
+			std::shared_ptr<NativeCode> native;
+			NativeCode::Kernel scalarKernel = nullptr;
+			NativeCode::Kernel batchKernel = nullptr;
+		};
+		// Program of an expression never set or that failed to compile, shared so constructing an expression allocates nothing
+		static const std::shared_ptr<const Program>& emptyProgram();
+		// Current program and the one being compiled
+		std::shared_ptr<const Program> program = emptyProgram();
+		std::shared_ptr<Program> building;
+
+		// Least recently used compiled programs by key, shared by every expression
+		struct Cache {
+			std::mutex mutex;
+			// Most recently used first
+			typedef std::list<std::pair<std::string, std::shared_ptr<const Program>>> Entries;
+			Entries entries;
+			std::unordered_map<std::string, typename Entries::iterator> index;
+			CacheStats stats;
+		};
+		static Cache& cache();
+		// Key of the current program in the cache, empty if it is not cached
+		// The normalized expression string, prefixed with n for native code or i for the interpreter and the accuracy
+		std::string cacheKey;
+		// Prefix of the keys of programs compiled with the current settings
+		std::string cachePrefix() const;
+		// Append the expression string to a key, lowercase and with whitespace only where it separates two tokens
+		static void normalize(std::string_view input, std::string& key);
+		// Find a program and mark it most recently used, null if the cache does not hold it
+		static std::shared_ptr<const Program> cacheFind(const std::string& key);
+		// Add a program, dropping the least recently used past the capacity
+		static void cacheStore(const std::string& key, const std::shared_ptr<const Program>& program);
+		// Get a program with other values for its slots when compiled, a copy sharing the native code if they differ
+		static std::shared_ptr<const Program> withDefaults(const std::shared_ptr<const Program>& program, const std::vector<T>& defaults);
+
+		// Whether bind() handed out each slot
+		std::vector<bool> slotBound;
+
+		// Peek next token, bounds check, None once a problem was found
+		Token peek();
+
+		// Record the first problem, stopping the tokenizer and the parser
+		void fail(size_t position, const std::string& message);
+		// Offset into the expression string of the next token, the end of the string past the last one
+		size_t tokenPosition() const;
+
+		// Append an instruction to the program and return its register
+		int emit(Instruction instruction);
+		// Call of a function at an accuracy
+		static Instruction call(Function function, Accuracy accuracy, int a);
 
-		// Pi
-		T const pi = std::acos(-T(1));;
+		// How tightly a binary operator binds, higher first
+		static int precedence(Op op);
+		// Parse the tokens into instructions and return the register of the result
+		int parseExpression();
 
-		// Power stack 
-		std::vector<T> powerStack;
+		// Number of registers an instruction reads
+		static int arity(Op op);
+		// Apply an instruction to the values of its operands
+		static T apply(const Instruction& instruction, T a, T b);
+		// Apply an instruction to the ranges of its operands, function calls have the given accuracy
+		static Interval applyInterval(const Instruction& instruction, Accuracy accuracy, Interval a, Interval b);
+		// Partial derivatives of an instruction along its operands a and b, r is the value of the instruction
+		static void partials(const Instruction& instruction, T r, T a, T b, T& pa, T& pb);
+		// Derivative of an instruction from the values and derivatives of its operands, r is the value of the instruction
+		static T applyDerivative(const Instruction& instruction, T r, T a, T b, T da, T db);
+		// Fold constants, reduce strength, drop identities and merge repeated subexpressions in the program being compiled
+		void optimize();
+		// Product waiting for the end of its loop to get its derivative, the Next of loop finishes it
+		struct PendingProduct {
+			int loop;
+			int product;
+			int logarithmic;
+		};
+		// Append the derivative of instruction r to instructions and put its register in d[r], -1 where it is zero
+		// d holds the derivative of every earlier register, variables are left to the caller
+		static void differentiate(std::vector<Instruction>& instructions, Accuracy accuracy, int r, std::vector<int>& d, std::vector<PendingProduct>& pending);
+
+		// Raise a to the power of b, callable from native code
+		static T power(T a, T b);
+		// Min and max, which give NaN if either value is not a number, atan2 of a over b and a < b, callable from native code
+		static T minimum(T a, T b);
+		static T maximum(T a, T b);
+		static T arctangent(T a, T b);
+		static T less(T a, T b);
+		// Counter of the first pass of a loop, NaN if the loop would make more than MaxPasses passes or count inexactly
+		static T loopStart(T first, T last);
+		// Whether a loop makes another pass after the one with counter k
+		static bool loopAgain(T k, T last);
+		// Fold the term of the pass with counter k into a sum or product, or its derivative into the derivative of one
+		// Passes beyond the last leave the accumulator as it is, so lanes that finish early can keep running
+		static T accumulate(Op op, T accumulator, T term, T k, T first, T last);
+		static T accumulateDerivative(Op op, T accumulator, T term, T dAccumulator, T dTerm, T k, T first, T last);
+		// Append a kernel running the program one lane or one SSE register of lanes at a time
+		static void emitKernel(std::vector<unsigned char>& code, const Program& program, bool packed);
+		// Generate native code for a program, see exprjit.cpp
+		void compileNative(Program& program) const;
+		// Fill the slot table of the context for native code
+		static void prepareNative(const Program& program, Context& context, const std::vector<T>& slots, const Slot* inputs, const T* const* columns, int columnCount);
+
+		// Find or create the slot of a variable name while compiling, position is where it appears
+		int intern(const std::string& name, size_t position);
+
+		// Find the slot of a variable name, the unused slot if the program does not reference it
+		int find(const std::string& name) const;
+
+		// Size the context for a program
+		static void prepare(const Program& program, Context& context);
 
-		// Peek next token, bounds check
-		typename Token peek();
+		// Solve a program for n samples, reading variables from slots unless they have a column
+		static void runBatch(const Program& program, Context& context, const std::vector<T>& slots, const Slot* inputs, const T* const* columns, int columnCount, T* out, size_t n);
+		// Solve a program with native code for n samples, out holds a column for the result and one for each output
+		static void runNative(const Program& program, Context& context, const std::vector<T>& slots, const Slot* inputs, const T* const* columns, int columnCount, T* const* out, size_t n);
 
-		// [v]alue = literal | (e)
-		T parseValue();
-		// [p]ower = function(v) | variable | v
-		T parsePower();
-		// [f]actor = f ^ p | p
-		T parseFactor();
-		// [t]erm = t * f | t / f | f
-		T parseTerm();
-		// [e]xpression = t + e | t - e | t
-		T parseExpression();
+		// Solve a program and its derivatives along x and y for n samples
+		// Slot s has the derivatives seeds[s * 2] and seeds[s * 2 + 1], unless it has a column of derivatives along x
+		static void runGradient(const Program& program, Context& context, const std::vector<T>& slots, const std::vector<T>& seeds, const Slot* inputs, const T* const* columns, const T* const* dxColumns, int columnCount, T* out, T* dx, T* dy, size_t n);
 
-		// Tokenize input string
-		void tokenize(std::string input);
+		// Solve the instructions of a program that have the given dependence on the grid
+		// value is the grid variable the instructions depend on, other variables are read from slots
+		// If derivatives is not null it receives the derivative of each of those instructions along the grid variable
+		static void solvePart(const Program& program, const std::vector<unsigned char>& dependence, unsigned char part, const std::vector<T>& slots, T value, T* registers, T* derivatives = nullptr);
+		// Native program solving the point program of a grid and its derivatives along x and y, null if there is no native code
+		// Slot k of the point program holds the source register hoisted[k], whose dependence on the grid is in dependence
+		std::shared_ptr<const Program> makeGradient(const Program& point, const std::vector<int>& hoisted, const std::vector<unsigned char>& dependence) const;
 
+		// Find or add the lowercase form of an identifier in names
+		int internName(std::string_view identifier);
+
+		// Tokenize input string in a single pass, skipping whitespace
+		void tokenize(std::string_view input);
+
+		// Compile the tokens into the program, leaving it empty if there is a problem
+		void compile();
+
+
+		// Context used by the map based solve()
+		Context mapContext;
 
 	public:
 		// Associate a variable with a value
 		// e.g. myExpr.variables["x"] = 4;
-		std::unordered_map<std::string, T> variables = { {"pi", pi} };
-		// Set expression
-		void set(std::string expression);
-		// Solve expression
+		// Constants such as pi are built in, a variable of the same name replaces the constant
+		std::unordered_map<std::string, T> variables;
+		// Compile to native code when the expression is set, where the platform supports it
+		// e.g. myExpr.jit = false; myExpr.set("x^2"); runs x^2 on the interpreter
+		bool jit = true;
+		// Accuracy of the functions when the expression is set, see exprmath.hpp
+		// e.g. myExpr.accuracy = ExprUtil::Accuracy::Fast; myExpr.set("sin(x)"); runs a polynomial within 1e-4 of sin
+		Accuracy accuracy = Accuracy::Exact;
+		// Set expression, see diagnostic() for any problem
+		// An expression compiled recently by any Expression of this type is taken from the cache, skipping compilation
+		// Besides functions of one value there are min(a, b, ...), max(a, b, ...), atan2(y, x) and the series
+		// sum(k, first, last, term) and prod(k, first, last, term) over k = first, first + 1, ... up to last,
+		// whose term is compiled once and run in a loop, which native code leaves to the interpreter
+		// e.g. myExpr.set("sum(k, 1, 200, sin(k*x)*cos(k*y)/k)");
+		void set(std::string_view expression);
+		// Set how many compiled programs the cache holds, 0 turns it off
+		// e.g. ExprUtil::ExprFloat::setCacheCapacity(256);
+		static void setCacheCapacity(size_t capacity);
+		// Get the counters of the cache
+		static CacheStats cacheStats();
+		// Drop every program from the cache
+		static void clearCache();
+		// Register a function callable from every expression of this type, matched regardless of case like the built in ones
+		// batch(in, out, n) must give out[i] == scalar(in[i]) bit for bit with in and out not overlapping, or be null to call scalar once per value
+		// Fails if the name is not a letter followed by letters and digits or is a built in function or constant, defining a name again replaces its function
+		// Derivatives and ranges of a registered function are not known and come out as NaN
+		// e.g. ExprUtil::ExprFloat::define("sinc", sinc, sincBatch); ExprUtil::ExprFloat expr("sinc(x)*y");
+		static bool define(std::string_view name, FnPtr scalar, BatchFn batch = nullptr);
+		// Get the problem found when the expression was last set, if any
+		// e.g. if (!myExpr.diagnostic().ok()) { std::cout << myExpr.diagnostic().message; }
+		const Diagnostic& diagnostic() const;
+		// Check if the expression runs as native code
+		bool isNative() const;
+		// Resolve a variable name to its slot, valid until the expression is set again
+		Slot bind(const std::string& name);
+		// Create a context for this expression with every variable at its value when compiled
+		Context makeContext() const;
+		// Get the size of the compiled program
+		Stats stats() const;
+		// Solve expression reading variables from the map
 		T solve();
-		// Check if the function is valid by solving once
-		bool isValid();
+		// Solve expression reading variables from the slots of the context
+		// Never throws, domain errors and an expression that failed to compile give NaN
+		// Safe to call from several threads at once as long as each uses its own context
+		T solve(Context& context) const;
+		// Solve expression for n samples at once, out[i] matches solve() with slots[inputs[c]] = columns[c][i]
+		// Slots without a column keep their value in the context for every sample
+		void solveBatch(Context& context, const Slot* inputs, const T* const* columns, int columnCount, T* out, size_t n) const;
+		// Solve expression for n samples of x and y at once
+		// e.g. myExpr.solveBatch(ctx, xs, ys, heights, count);
+		void solveBatch(Context& context, const T* x, const T* y, T* out, size_t n) const;
+		// Solve expression together with its partial derivatives along slotX and slotY for n samples at once
+		// out matches solveBatch(), dx[i] and dy[i] are the derivatives at the same sample, carried through every instruction as dual numbers
+		// e.g. myExpr.solveGradient(ctx, slotX, slotY, &slotX, &xs, 1, heights, dx, dy, count);
+		void solveGradient(Context& context, Slot slotX, Slot slotY, const Slot* inputs, const T* const* columns, int columnCount, T* out, T* dx, T* dy, size_t n) const;
+		// Differentiate expression symbolically along a variable, giving a new compiled and optimized expression
+		// The derivative has the same slots and variables as this expression, so contexts and slots carry over
+		// Derivatives are cached along with the expression
+		// e.g. ExprUtil::ExprFloat dx = myExpr.derivative("x"); dx.solveBatch(ctx, xs, ys, slopes, count);
+		Expression derivative(const std::string& name) const;
+		// Split of the expression over a grid of x and y, see makeGrid()
+		struct Grid {
+			// Program the grid was made from
+			std::shared_ptr<const Program> source;
+			// Dependence of each source instruction on the grid, 0 none, 1 x only, 2 y only, 3 both
+			std::vector<unsigned char> dependence;
+			// Source registers with every instruction that depends on neither x nor y solved
+			std::vector<T> registers;
+			// Program solved for every point, its slots hold the source registers in hoisted
+			std::shared_ptr<const Program> program;
+			std::vector<int> hoisted;
+			// Slots of the point program that depend only on x, and their value for every x, one column after another
+			std::vector<Slot> columnSlots;
+			std::vector<T> columns;
+			// Derivatives along x of the columns
+			std::vector<T> columnDerivatives;
+			// Native code for the point program carrying derivatives along x and y, null where runGradient() runs instead
+			// Its slots hold the hoisted values followed by their derivative, and it outputs the value then both derivatives
+			std::shared_ptr<const Program> gradient;
+			// Slots of the gradient program fed by a column, those of the values then those of their derivatives along x
+			std::vector<Slot> gradientSlots;
+			size_t width = 0;
+		};
+		// Split the expression over a grid of width x values, solving everything that depends only on x once per column
+		// Other variables keep their value in the context for every solveGrid() with this grid
+		Grid makeGrid(const Context& context, Slot slotX, const T* x, size_t width, Slot slotY) const;
+		// Solve expression on the columns [first, first + count) of height rows of the grid, one row for each y
+		// out[i * count + j] matches solve() with x = x[first + j] and y = y[i]. Parts that depend only on y are solved once per row
+		// If dx and dy are not null they receive the partial derivatives like solveGradient(), from native code where the
+		// expression has some. Where a partial is infinite or not a number, like that of sqrt or abs at 0, native code may give
+		// NaN and solveGradient() 0
+		// e.g. Grid grid = myExpr.makeGrid(ctx, slotX, xs, w, slotY); myExpr.solveGrid(ctx, grid, ys, h, 0, w, heights);
+		void solveGrid(Context& context, const Grid& grid, const T* y, size_t height, size_t first, size_t count, T* out, T* dx = nullptr, T* dy = nullptr) const;
+		// Bound expression over a box where slots[inputs[c]] ranges over ranges[c], other slots keep their value in the context
+		// Every value solve() gives inside the box lies in the result
+		// e.g. Interval range = myExpr.solveInterval(ctx, inputs, ranges, 2); if (range.hi < 0) { ... }
+		Interval solveInterval(Context& context, const Slot* inputs, const Interval* ranges, int count) const;
+		// Check the expression compiled and that every variable it reads is bound or in the map
+		Diagnostic validate() const;
+		// Check if the function is valid, see validate()
+		bool isValid() const;
 		// Constructor
 		Expression();
 		// Constructor that sets expression
 		// e.g. ExprUtil::ExpressionFloat expr("x^2/sin(2*pi/y)-x/2");
-		Expression(std::string expression);
+		Expression(std::string_view expression);
 	};
 
 	// Instantiation
@@ -97,4 +490,4 @@ namespace ExprUtil {
 	typedef Expression<double> ExprDouble;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,15 +1,21 @@
 #version 330 core
 
 in vec4 color;
+in vec3 normal;
 out vec4 outputF;
 
+// Light shining down from above and in front
+const vec3 lightDir = normalize(vec3(0.4, 1.0, 0.6));
 
 void main() {
+	// Light both sides of the surface, keeping some ambient so nothing goes black
+	float diffuse = abs(dot(normalize(normal), lightDir));
+	vec4 litColor = vec4(color.rgb * (0.35 + 0.65 * diffuse), color.a);
 	vec4 mainColor;
 	if (!gl_FrontFacing) {
-		mainColor = color;
+		mainColor = litColor;
 	} else {
-		mainColor = mix(color, vec4(0.0, 0.0, 1.0, 1.0), 0.2);
+		mainColor = mix(litColor, vec4(0.0, 0.0, 1.0, 1.0), 0.2);
 	}
 	outputF = mainColor;
 }
\ No newline at end of file
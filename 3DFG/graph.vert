@@ -1,25 +1,35 @@
 #version 330 core
 
-layout(location = 0) in vec3 vPos;
-layout(location = 1) in float height1;
-layout(location = 2) in float height2;
+layout(location = 3) in vec3 normal1;
+layout(location = 4) in vec3 normal2;
 
 out vec4 color;
+out vec3 normal;
 
 uniform mat4 MVP;
 uniform float weight;
+// Squares along each side of the grid, it has res + 1 vertices per row
+uniform int res;
+// Heights 1 and 2 as layers 0 and 1, one texel per vertex, offset by 0.5 into [0, 1]
+uniform sampler2DArray heights;
 
 void main() {
+	// Place the vertex on the grid from its index, offset by 0.5 so 0,0,0 is the middle
+	int row = gl_VertexID / (res + 1);
+	int column = gl_VertexID - row * (res + 1);
 	// Get new positions
+	float height1 = texelFetch(heights, ivec3(column, row, 0), 0).r - 0.5;
+	float height2 = texelFetch(heights, ivec3(column, row, 1), 0).r - 0.5;
 	float newY = mix(height1, height2, weight);
-	vec3 finalPos = vec3(vPos.x, newY, vPos.z);
+	vec3 finalPos = vec3(float(column) / float(res) - 0.5, newY, float(row) / float(res) - 0.5);
 
 	gl_Position = MVP * vec4(finalPos, 1.0);
 
 	// Color based on vertex y position
 	vec3 color1 = vec3(0.5, 0.0, 0.7); // Lowest point
 	vec3 color2 = vec3(0.9, 0.9, 1.0); // Highest point
-	vec3 heightColor = mix(color1, color2, finalPos.y * 2); // change vPos to finalPos
+	vec3 heightColor = mix(color1, color2, finalPos.y * 2);
 
 	color = vec4(heightColor, 1.0);
+	normal = mix(normal1, normal2, weight);
 }
\ No newline at end of file
@@ -233,11 +233,9 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 		if (!inputStr.empty()) {
 			if (currInMode == InputMode::Func) {
 				if (graph.setExpression(inputStr)) {
-					// Set the heights
+					// Start computing the heights, only if the function was properly set
+					// The animation starts once they are ready
 					graph.setHeights();
-					// Only animate if the function was properly set
-					animAcc = 0;
-					animating = true;
 				}
 			} else {
 				// Set up stringstream to parse string into number pair
@@ -261,11 +259,8 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 					graph.setRangeZ(range);
 					break;
 				}
-				// Set the heights
+				// Start computing the heights, the animation starts once they are ready
 				graph.setHeights();
-				// Animate
-				animAcc = 0;
-				animating = true;
 			}
 		}
 		// Clear input
@@ -323,11 +318,17 @@ void display() {
 	glm::mat4 modelMatrix(1.0f);
 	// Graph
 	graphShader.use();
+	// Animate to new heights once they are ready
+	if (graph.update()) {
+		animAcc = 0;
+		animating = true;
+	}
 	// Graph animation
 	if (animating) {
 		animate(2.5);
 	}
 	glUniformMatrix4fv(graphShader.uniforms["MVP"], 1, GL_FALSE, glm::value_ptr(cam.projectionMatrix * cam.viewMatrix * modelMatrix));
+	glUniform1i(graphShader.uniforms["res"], graph.getRes());
 	graph.render();
 	// Cube
 	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -421,6 +422,7 @@ void initGL() {
 	graphShader = Shader("graph.vert", "graph.frag");
 	graphShader.uniforms["MVP"] = glGetUniformLocation(graphShader.id, "MVP");
 	graphShader.uniforms["weight"] = glGetUniformLocation(graphShader.id, "weight");
+	graphShader.uniforms["res"] = glGetUniformLocation(graphShader.id, "res");
 	cubeShader = Shader("cube.vert", "cube.frag");
 	cubeShader.uniforms["MVP"] = glGetUniformLocation(cubeShader.id, "MVP");
 	textShader = Shader("text.vert", "text.frag");
@@ -448,6 +450,8 @@ void mainLoop() {
 }
 
 void cleanup() {
+	// Release GL objects while the context still exists
+	graph.destroy();
 	glfwDestroyWindow(window);
 	glfwTerminate();
 }
@@ -0,0 +1,60 @@
+// STD
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <string>
+// User
+#include "bench.hpp"
+
+// Milliseconds a call of run takes
+double Bench::time(const std::function<void()>& run, int repeats) {
+	run();
+	double best = std::numeric_limits<double>::infinity();
+	for (int i = 0; i < repeats; i++) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		run();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		best = std::min(best, elapsed.count());
+	}
+	return best;
+}
+
+// Run the benchmarks named on the command line, or all of them
+// e.g. Bench pool
+int main(int argc, char* argv[]) {
+	struct Entry {
+		const char* name;
+		void(*run)();
+	};
+	const Entry benchmarks[] = {
+		{ "pool", Bench::pool },
+		{ "jit", Bench::jit },
+		{ "gradient", Bench::gradient },
+		{ "parse", Bench::parse },
+		{ "strips", Bench::strips },
+		{ "upload", Bench::upload }
+	};
+	bool ran = false;
+	for (const Entry& entry : benchmarks) {
+		bool selected = argc < 2;
+		for (int i = 1; i < argc; i++) {
+			selected = selected || entry.name == std::string(argv[i]);
+		}
+		if (selected) {
+			std::cout << "== " << entry.name << " ==\n";
+			entry.run();
+			std::cout << "\n";
+			ran = true;
+		}
+	}
+	if (!ran) {
+		std::cout << "Usage: Bench [name...], where name is one of";
+		for (const Entry& entry : benchmarks) {
+			std::cout << " " << entry.name;
+		}
+		std::cout << "\n";
+		return 1;
+	}
+	return 0;
+}
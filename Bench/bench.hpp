@@ -0,0 +1,28 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// STD
+#include <functional>
+
+namespace Bench {
+
+	// Milliseconds a call of run takes, the best of repeats calls after one to warm up
+	double time(const std::function<void()>& run, int repeats = 5);
+
+	// Benchmarks, each prints a table to std::cout
+	// Scaling of the grid evaluation in Graph::setHeights() with the number of workers of the pool
+	void pool();
+	// Recursive evaluation, as before expressions were compiled, against the bytecode interpreter and native code
+	// Graph::setHeights() solves a grid with gradients instead, which gradient() times
+	void jit();
+	// Heights alone against heights with their gradient for lighting, on the interpreter and as native code
+	void gradient();
+	// Compile and evaluation time per term as expressions grow, and compile time of deep nesting
+	void parse();
+	// Index size and vertex cache efficiency of the triangle list against the banded strips of Graph::build()
+	void strips();
+	// Bytes and time of uploading a layer of heights as floats and as 16 bit normalized integers, in a hidden window
+	void upload();
+}
+
+#endif
@@ -0,0 +1,47 @@
+// STD
+#include <cstdio>
+#include <iostream>
+#include <vector>
+// User
+#include "bench.hpp"
+#include "exprutil.hpp"
+
+// Heights alone against heights and gradients on the interpreter and as native code, over the grid of Graph::setHeights()
+void Bench::gradient() {
+	const int res = 1024;
+	const size_t rows = res + 1;
+	const char* sources[] = {
+		"sin(x)*cos(y)",
+		"x*y/25",
+		"10*sin(x*y)",
+		"sin(x*y)*exp(-(x*x+y*y)/8)"
+	};
+	std::vector<float> xs(rows), ys(rows);
+	for (size_t i = 0; i < rows; i++) {
+		xs[i] = ys[i] = -10.0f + 20.0f * (float)i / (float)res;
+	}
+	std::vector<float> heights(rows * rows), dx(rows * rows), dy(rows * rows);
+	std::cout << rows << "x" << rows << " grid, float, Accuracy::Fast as in Graph, one thread, ms\n";
+	std::printf("%-30s %10s %12s %12s\n", "expression", "heights", "interpreter", "jit");
+	for (const char* source : sources) {
+		double ms[3];
+		for (int mode = 0; mode < 3; mode++) {
+			ExprUtil::ExprFloat expression;
+			expression.jit = mode != 1;
+			expression.accuracy = ExprUtil::Accuracy::Fast;
+			expression.set(source);
+			ExprUtil::ExprFloat::Slot slotX = expression.bind("x");
+			ExprUtil::ExprFloat::Slot slotY = expression.bind("y");
+			ExprUtil::ExprFloat::Context context = expression.makeContext();
+			ExprUtil::ExprFloat::Grid grid = expression.makeGrid(context, slotX, xs.data(), rows, slotY);
+			ms[mode] = time([&] {
+				if (mode == 0) {
+					expression.solveGrid(context, grid, ys.data(), rows, 0, rows, heights.data());
+				} else {
+					expression.solveGrid(context, grid, ys.data(), rows, 0, rows, heights.data(), dx.data(), dy.data());
+				}
+			});
+		}
+		std::printf("%-30s %10.1f %12.1f %12.1f\n", source, ms[0], ms[1], ms[2]);
+	}
+}
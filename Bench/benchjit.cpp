@@ -0,0 +1,202 @@
+// STD
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+// User
+#include "bench.hpp"
+#include "exprutil.hpp"
+
+namespace {
+
+	// Evaluator that walks the tokens recursively on every solve, as Expression did before it compiled programs
+	// Variables and functions are looked up by name in maps each time they are read
+	class Recursive {
+	private:
+		enum class Token {
+			None,
+			Plus,
+			Minus,
+			Multiply,
+			Divide,
+			Pow,
+			OpenP,
+			ClosedP,
+			String,
+			Literal
+		};
+		typedef float(*FnPtr)(float);
+		std::unordered_map<std::string, FnPtr> funcMap{
+			{ "sin", std::sin },
+			{ "cos", std::cos },
+			{ "tan", std::tan },
+			{ "abs", std::fabs },
+			{ "exp", std::exp },
+			{ "log", std::log },
+			{ "sqrt", std::sqrt }
+		};
+		std::vector<Token> tokens;
+		std::vector<float> literals;
+		std::vector<std::string> strings;
+		size_t indexTok = 0, indexLit = 0, indexStr = 0;
+
+		Token peek() const {
+			return indexTok < tokens.size() ? tokens[indexTok] : Token::None;
+		}
+		// [v]alue = literal | (e)
+		float parseValue() {
+			float value = 0;
+			if (peek() == Token::Literal) {
+				value = literals[indexLit++];
+				++indexTok;
+			} else if (peek() == Token::OpenP) {
+				++indexTok;
+				value = parseExpression();
+				++indexTok;
+			}
+			return value;
+		}
+		// [p]ower = function(v) | variable | v
+		float parsePower() {
+			float sign = 1;
+			if (peek() == Token::Minus) {
+				++indexTok;
+				sign = -1;
+			}
+			float value = 0;
+			if (peek() == Token::String) {
+				++indexTok;
+				if (peek() == Token::OpenP) {
+					FnPtr fn = funcMap.find(strings[indexStr++])->second;
+					value = fn(parseValue());
+				} else {
+					value = variables.find(strings[indexStr++])->second;
+				}
+			} else {
+				value = parseValue();
+			}
+			return sign * value;
+		}
+		// [f]actor = p ^ f | p
+		float parseFactor() {
+			float power = parsePower();
+			if (peek() == Token::Pow) {
+				++indexTok;
+				power = std::pow(power, parseFactor());
+			}
+			return power;
+		}
+		// [t]erm = t * f | t / f | f
+		float parseTerm() {
+			float factor = parseFactor();
+			while (peek() == Token::Multiply || peek() == Token::Divide) {
+				bool multiply = peek() == Token::Multiply;
+				++indexTok;
+				factor = multiply ? factor * parseFactor() : factor / parseFactor();
+			}
+			return factor;
+		}
+		// [e]xpression = e + t | e - t | t
+		float parseExpression() {
+			float term = parseTerm();
+			while (peek() == Token::Plus || peek() == Token::Minus) {
+				bool plus = peek() == Token::Plus;
+				++indexTok;
+				term = plus ? term + parseTerm() : term - parseTerm();
+			}
+			return term;
+		}
+
+	public:
+		std::unordered_map<std::string, float> variables{ { "pi", 3.14159265358979323846f } };
+
+		// Tokenize once, expressions are assumed to be valid
+		Recursive(const char* expression) {
+			const char* symbols = "+-*/^()";
+			for (const char* it = expression; *it != 0;) {
+				if (const char* symbol = std::strchr(symbols, *it)) {
+					tokens.push_back((Token)((int)Token::Plus + (symbol - symbols)));
+					++it;
+				} else if (std::isalpha((unsigned char)*it)) {
+					const char* first = it;
+					while (std::isalnum((unsigned char)*it)) {
+						++it;
+					}
+					tokens.push_back(Token::String);
+					strings.emplace_back(first, it);
+				} else if (std::isdigit((unsigned char)*it) || *it == '.') {
+					char* last = nullptr;
+					literals.push_back(std::strtof(it, &last));
+					tokens.push_back(Token::Literal);
+					it = last;
+				} else {
+					++it;
+				}
+			}
+		}
+		// Parse and evaluate the tokens
+		float solve() {
+			indexTok = 0;
+			indexLit = 0;
+			indexStr = 0;
+			return parseExpression();
+		}
+	};
+}
+
+// Recursive evaluation against the compiled program on the interpreter and as native code
+void Bench::jit() {
+	const int res = 1024;
+	const size_t rows = res + 1;
+	const size_t count = rows * rows;
+	const char* sources[] = {
+		"x^2/sin(2*pi/y)-x/2",
+		"x*y-x/2+y*y*3",
+		"(x+y)*(x-y)/(1+x*x+y*y)",
+		"exp(-x*x-y*y)*log(abs(y)+1)"
+	};
+	// Every vertex of the grid Graph::setHeights() solves, one after another
+	std::vector<float> xs(count), ys(count), out(count), reference(count);
+	for (size_t i = 0; i < rows; i++) {
+		for (size_t j = 0; j < rows; j++) {
+			xs[i * rows + j] = -5.0f + 10.0f * (float)j / (float)res;
+			ys[i * rows + j] = -5.0f + 10.0f * (float)i / (float)res;
+		}
+	}
+	std::cout << rows << "x" << rows << " samples, float, one thread, ms\n";
+	std::printf("%-30s %10s %10s %10s  %s\n", "expression", "recursive", "bytecode", "jit", "jit matches bytecode");
+	for (const char* source : sources) {
+		Recursive recursive(source);
+		double recursiveMs = time([&] {
+			for (size_t i = 0; i < count; i++) {
+				recursive.variables["x"] = xs[i];
+				recursive.variables["y"] = ys[i];
+				out[i] = recursive.solve();
+			}
+		}, 3);
+		ExprUtil::ExprFloat bytecode;
+		bytecode.jit = false;
+		bytecode.set(source);
+		ExprUtil::ExprFloat::Context bytecodeContext = bytecode.makeContext();
+		double bytecodeMs = time([&] {
+			bytecode.solveBatch(bytecodeContext, xs.data(), ys.data(), reference.data(), count);
+		});
+		ExprUtil::ExprFloat native;
+		native.set(source);
+		ExprUtil::ExprFloat::Context nativeContext = native.makeContext();
+		double nativeMs = time([&] {
+			native.solveBatch(nativeContext, xs.data(), ys.data(), out.data(), count);
+		});
+		// Compare bit patterns so NaN matches NaN
+		bool matches = std::memcmp(out.data(), reference.data(), count * sizeof(float)) == 0;
+		if (native.isNative()) {
+			std::printf("%-30s %10.1f %10.1f %10.1f  %s\n", source, recursiveMs, bytecodeMs, nativeMs, matches ? "yes" : "no");
+		} else {
+			std::printf("%-30s %10.1f %10.1f %10s\n", source, recursiveMs, bytecodeMs, "n/a");
+		}
+	}
+}
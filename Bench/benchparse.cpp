@@ -0,0 +1,52 @@
+// STD
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+// User
+#include "bench.hpp"
+#include "exprutil.hpp"
+
+// Compile and evaluation time of expressions of growing length, and compile time of deep nesting
+void Bench::parse() {
+	// Every compile is cold
+	ExprUtil::ExprFloat::CacheStats cache = ExprUtil::ExprFloat::cacheStats();
+	ExprUtil::ExprFloat::setCacheCapacity(0);
+	const size_t samples = 256;
+	std::vector<float> xs(samples), ys(samples), out(samples);
+	for (size_t i = 0; i < samples; i++) {
+		xs[i] = -5.0f + 10.0f * (float)i / (float)samples;
+		ys[i] = 5.0f - 10.0f * (float)i / (float)samples;
+	}
+	// Fourier series written out term by term, sin(1*x)*cos(1*y)/1+sin(2*x)*cos(2*y)/2+...
+	std::cout << "Fourier series of sin(k*x)*cos(k*y)/k written out, interpreter, " << samples << " samples\n";
+	std::printf("%8s %16s %22s\n", "terms", "compile us/term", "solve ns/term/sample");
+	for (int terms = 10; terms <= 100000; terms *= 10) {
+		std::string source;
+		for (int k = 1; k <= terms; k++) {
+			std::string n = std::to_string(k);
+			source += (k > 1 ? "+sin(" : "sin(") + n + "*x)*cos(" + n + "*y)/" + n;
+		}
+		ExprUtil::ExprFloat expression;
+		expression.jit = false;
+		int repeats = terms >= 10000 ? 1 : 5;
+		double compileMs = time([&] {
+			expression.set(source);
+		}, repeats);
+		ExprUtil::ExprFloat::Context context = expression.makeContext();
+		double solveMs = time([&] {
+			expression.solveBatch(context, xs.data(), ys.data(), out.data(), samples);
+		}, repeats);
+		std::printf("%8d %16.2f %22.1f\n", terms, compileMs * 1e3 / terms, solveMs * 1e6 / terms / samples);
+	}
+	// Nesting only grows the stacks of the parser, not the call stack
+	const size_t depth = 1000000;
+	std::string nested = std::string(depth, '(') + "x" + std::string(depth, ')');
+	ExprUtil::ExprFloat expression;
+	expression.jit = false;
+	double nestedMs = time([&] {
+		expression.set(nested);
+	}, 1);
+	std::printf("%zu nested parentheses compile in %.1f ms%s\n", depth, nestedMs, expression.diagnostic().ok() ? "" : ", with a diagnostic");
+	ExprUtil::ExprFloat::setCacheCapacity(cache.capacity);
+}
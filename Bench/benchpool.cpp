@@ -0,0 +1,58 @@
+// STD
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <vector>
+// User
+#include "bench.hpp"
+#include "exprutil.hpp"
+#include "ThreadPool.hpp"
+
+// Scaling of the grid evaluation in Graph::setHeights() with the number of workers of the pool
+// The grid is split into tiles of 16 rows and solved row by row like Graph::solveTile(), without the normals
+void Bench::pool() {
+	const int res = 1024;
+	const size_t rows = res + 1;
+	const size_t tileRows = 16;
+	const size_t tiles = (rows + tileRows - 1) / tileRows;
+	const char* source = "sin(x*y)*exp(-(x*x+y*y)/8)";
+	ExprUtil::ExprFloat expression;
+	expression.accuracy = ExprUtil::Accuracy::Fast;
+	expression.set(source);
+	ExprUtil::ExprFloat::Slot slotX = expression.bind("x");
+	ExprUtil::ExprFloat::Slot slotY = expression.bind("y");
+	std::vector<float> rowX(rows), rowY(rows), heights(rows * rows);
+	for (size_t j = 0; j < rows; j++) {
+		rowX[j] = -5.0f + 10.0f * (float)j / (float)res;
+		rowY[j] = -5.0f + 10.0f * (float)j / (float)res;
+	}
+	ExprUtil::ExprFloat::Context context = expression.makeContext();
+	ExprUtil::ExprFloat::Grid grid = expression.makeGrid(context, slotX, rowX.data(), rows, slotY);
+	// 1, 2, 4, ... workers up to one per hardware thread
+	unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> counts;
+	for (unsigned int n = 1; n < hardware; n *= 2) {
+		counts.push_back(n);
+	}
+	counts.push_back(hardware);
+	std::cout << rows << "x" << rows << " grid of " << source << ", " << hardware << " hardware threads\n";
+	std::cout << "threads        ms   speedup\n";
+	double single = 0;
+	for (unsigned int n : counts) {
+		ThreadPool pool(n);
+		std::vector<ExprUtil::ExprFloat::Context> contexts(pool.size(), context);
+		double ms = time([&] {
+			pool.parallelFor(tiles, [&](size_t tile, unsigned int worker) {
+				size_t end = std::min(rows, (tile + 1) * tileRows);
+				for (size_t i = tile * tileRows; i < end; i++) {
+					expression.solveGrid(contexts[worker], grid, &rowY[i], 1, 0, rows, &heights[i * rows]);
+				}
+			});
+		});
+		if (n == 1) {
+			single = ms;
+		}
+		std::printf("%7u %9.2f %8.2fx\n", n, ms, single / ms);
+	}
+}
@@ -0,0 +1,82 @@
+// STD
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <vector>
+// User
+#include "bench.hpp"
+
+namespace {
+
+	const uint32_t restart = 0xFFFFFFFF;
+
+	// Triangle list of the grid as Graph::build() made it before strips, two triangles per cell
+	std::vector<uint32_t> triangleList(int res) {
+		std::vector<uint32_t> indices;
+		for (int i = 0; i < res; i++) {
+			for (int j = 0; j < res; j++) {
+				uint32_t row1 = i * (res + 1);
+				uint32_t row2 = (i + 1) * (res + 1);
+				indices.insert(indices.end(), { row1 + j, row1 + j + 1, row2 + j + 1, row1 + j, row2 + j + 1, row2 + j });
+			}
+		}
+		return indices;
+	}
+
+	// Strips of the grid as Graph::build() makes them, one per row of each band of bandColumns columns
+	std::vector<uint32_t> bandedStrips(int res, int bandColumns) {
+		std::vector<uint32_t> indices;
+		for (int band = 0; band < res; band += bandColumns) {
+			for (int i = 0; i < res; i++) {
+				uint32_t row1 = i * (res + 1);
+				uint32_t row2 = (i + 1) * (res + 1);
+				for (int j = band; j <= std::min(res, band + bandColumns); j++) {
+					indices.push_back(row2 + j);
+					indices.push_back(row1 + j);
+				}
+				indices.push_back(restart);
+			}
+		}
+		return indices;
+	}
+
+	// Vertices shaded per triangle with a FIFO post-transform cache of the given size, restart indices are skipped
+	double acmr(const std::vector<uint32_t>& indices, size_t cacheSize, size_t triangles) {
+		std::deque<uint32_t> cache;
+		size_t misses = 0;
+		for (uint32_t index : indices) {
+			if (index == restart || std::find(cache.begin(), cache.end(), index) != cache.end()) {
+				continue;
+			}
+			misses++;
+			cache.push_back(index);
+			if (cache.size() > cacheSize) {
+				cache.pop_front();
+			}
+		}
+		return (double)misses / (double)triangles;
+	}
+}
+
+// Index size and vertex cache efficiency of the triangle list against the banded strips
+void Bench::strips() {
+	const int bandColumns = 6;
+	const size_t cacheSizes[] = { 16, 32 };
+	std::cout << "FIFO vertex cache simulation, bands of " << bandColumns << " columns\n";
+	std::printf("%5s %6s %14s %14s %12s %12s\n", "res", "cache", "list bytes", "strip bytes", "list ACMR", "strip ACMR");
+	for (int res : { 80, 254, 512 }) {
+		std::vector<uint32_t> list = triangleList(res);
+		std::vector<uint32_t> strips = bandedStrips(res, bandColumns);
+		size_t cells = (size_t)res * res;
+		// The list was always 32 bit, strips are 16 bit while every vertex and the restart index fit
+		size_t stripIndexBytes = (size_t)(res + 1) * (res + 1) < 0xFFFF ? 2 : 4;
+		double listBytes = (double)(list.size() * 4) / cells;
+		double stripBytes = (double)(strips.size() * stripIndexBytes) / cells;
+		for (size_t cacheSize : cacheSizes) {
+			std::printf("%5d %6zu %8.2f /cell %8.2f /cell %12.3f %12.3f\n", res, cacheSize, listBytes, stripBytes,
+				acmr(list, cacheSize, cells * 2), acmr(strips, cacheSize, cells * 2));
+		}
+	}
+}
@@ -0,0 +1,71 @@
+// GL
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+// STD
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+// User
+#include "bench.hpp"
+
+// Bytes and time of a height upload by Graph::uploadHeights(), float against 16 bit normalized heights
+// Each upload replaces a whole layer of a texture array from client memory and waits for the driver to finish with it
+void Bench::upload() {
+	// A hidden window only for its context
+	if (!glfwInit()) {
+		std::cout << "Failed to initialize GLFW\n";
+		return;
+	}
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow* window = glfwCreateWindow(64, 64, "Bench", nullptr, nullptr);
+	if (window == nullptr) {
+		std::cout << "Failed to create GLFW window\n";
+		glfwTerminate();
+		return;
+	}
+	glfwMakeContextCurrent(window);
+	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+		std::cout << "Failed to initialize GLAD\n";
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return;
+	}
+	std::cout << glGetString(GL_RENDERER) << ", one layer per upload, ms\n";
+	std::printf("%6s %8s %12s %10s %10s\n", "size", "format", "bytes", "ms", "GB/s");
+	const int sizes[] = { 256, 1024, 4096 };
+	for (int size : sizes) {
+		size_t count = (size_t)size * size;
+		std::vector<GLfloat> heights(count);
+		std::vector<GLushort> quantized(count);
+		for (size_t i = 0; i < count; i++) {
+			heights[i] = 0.5f + 0.5f * std::sin((float)(i % size) * 0.05f) * std::cos((float)(i / size) * 0.05f);
+			quantized[i] = (GLushort)std::lround(heights[i] * 65535.0f);
+		}
+		for (bool isQuantized : { false, true }) {
+			// Two layers like the graph, uploads alternate between them
+			GLuint texture = 0;
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, isQuantized ? GL_R16 : GL_R32F, size, size, 2, 0, GL_RED, isQuantized ? GL_UNSIGNED_SHORT : GL_FLOAT, nullptr);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			const void* data = isQuantized ? (const void*)quantized.data() : (const void*)heights.data();
+			size_t bytes = count * (isQuantized ? sizeof(GLushort) : sizeof(GLfloat));
+			int layer = 0;
+			double ms = time([&] {
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, size, size, 1, GL_RED, isQuantized ? GL_UNSIGNED_SHORT : GL_FLOAT, data);
+				glFinish();
+				layer = 1 - layer;
+			});
+			std::printf("%6d %8s %12zu %10.3f %10.2f\n", size, isQuantized ? "R16" : "R32F", bytes, ms, (double)bytes / (ms * 1e6));
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+			glDeleteTextures(1, &texture);
+		}
+	}
+	glfwDestroyWindow(window);
+	glfwTerminate();
+}
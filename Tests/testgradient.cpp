@@ -0,0 +1,85 @@
+// STD
+#include <cmath>
+#include <string>
+#include <vector>
+// User
+#include "tests.hpp"
+#include "exprutil.hpp"
+
+namespace {
+
+	// Heights and gradients of an expression on a grid
+	struct Solved {
+		std::vector<float> heights;
+		std::vector<float> dx;
+		std::vector<float> dy;
+		bool native = false;
+	};
+
+	Solved solveGrid(const char* source, bool jit, ExprUtil::Accuracy accuracy, const std::vector<float>& x, const std::vector<float>& y) {
+		ExprUtil::ExprFloat expression;
+		expression.jit = jit;
+		expression.accuracy = accuracy;
+		expression.set(source);
+		ExprUtil::ExprFloat::Slot slotX = expression.bind("x");
+		ExprUtil::ExprFloat::Slot slotY = expression.bind("y");
+		ExprUtil::ExprFloat::Context context = expression.makeContext();
+		ExprUtil::ExprFloat::Grid grid = expression.makeGrid(context, slotX, x.data(), x.size(), slotY);
+		Solved solved;
+		solved.heights.resize(x.size() * y.size());
+		solved.dx.resize(solved.heights.size());
+		solved.dy.resize(solved.heights.size());
+		solved.native = grid.gradient != nullptr;
+		expression.solveGrid(context, grid, y.data(), y.size(), 0, x.size(), solved.heights.data(), solved.dx.data(), solved.dy.data());
+		return solved;
+	}
+
+	// Whether two derivatives agree up to a tolerance
+	bool near(float a, float b, float tolerance) {
+		return (std::isnan(a) && std::isnan(b)) || std::abs(a - b) <= tolerance * (1.0f + std::abs(a));
+	}
+}
+
+// Native code solves grid heights exactly as the interpreter does and their gradients up to rounding
+// At Fast the derivatives of functions call the polynomials natively but the standard library on the interpreter
+void Tests::gradient() {
+	// An odd width leaves lanes after the last whole SSE register
+	std::vector<float> x(37);
+	std::vector<float> y(23);
+	for (size_t j = 0; j < x.size(); j++) {
+		x[j] = -3.1f + 6.3f * j / (x.size() - 1);
+	}
+	for (size_t i = 0; i < y.size(); i++) {
+		y[i] = -2.2f + 4.7f * i / (y.size() - 1);
+	}
+	const char* sources[] = {
+		"sin(x)*cos(y)",
+		"x*y/25",
+		"10*sin(x*y)",
+		"exp(-(x*x+y*y)/8)*sin(3*x-y)",
+		"atan2(y, x+5)+min(x, y)*max(x, 2)",
+		"x^2.5+log(y+3)/(1+x*x)",
+		"tan(x/7)-y^3",
+		"sqrt(x*x+y*y+1)",
+		"4",
+		"y"
+	};
+	for (const char* source : sources) {
+		for (ExprUtil::Accuracy accuracy : { ExprUtil::Accuracy::Exact, ExprUtil::Accuracy::Fast }) {
+			Solved interpreted = solveGrid(source, false, accuracy, x, y);
+			Solved native = solveGrid(source, true, accuracy, x, y);
+			float tolerance = accuracy == ExprUtil::Accuracy::Exact ? 1e-5f : 1e-3f;
+			check(native.native || !ExprUtil::NativeCode::supported(), std::string(source) + " has a native gradient");
+			bool heights = true;
+			bool gradients = true;
+			for (size_t k = 0; k < native.heights.size(); k++) {
+				heights = heights && (native.heights[k] == interpreted.heights[k] || (std::isnan(native.heights[k]) && std::isnan(interpreted.heights[k])));
+				gradients = gradients && near(native.dx[k], interpreted.dx[k], tolerance) && near(native.dy[k], interpreted.dy[k], tolerance);
+			}
+			check(heights, std::string(source) + " has the same heights natively");
+			check(gradients, std::string(source) + " has the same gradient natively");
+		}
+	}
+	// Sums and products loop, so their gradient stays on the interpreter
+	check(solveGrid("sum(k, 1, 3, sin(k*x))*y", true, ExprUtil::Accuracy::Exact, x, y).native == false, "a sum has no native gradient");
+}
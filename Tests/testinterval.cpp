@@ -0,0 +1,99 @@
+// STD
+#include <cmath>
+#include <limits>
+#include <string>
+// User
+#include "tests.hpp"
+#include "exprutil.hpp"
+
+namespace {
+
+	typedef ExprUtil::ExprFloat::Interval Interval;
+
+	// Bound an expression of x and y over a box
+	Interval bound(const char* source, Interval x, Interval y, ExprUtil::Accuracy accuracy = ExprUtil::Accuracy::Exact) {
+		ExprUtil::ExprFloat expression;
+		expression.accuracy = accuracy;
+		expression.set(source);
+		ExprUtil::ExprFloat::Slot inputs[2] = { expression.bind("x"), expression.bind("y") };
+		Interval ranges[2] = { x, y };
+		ExprUtil::ExprFloat::Context context = expression.makeContext();
+		return expression.solveInterval(context, inputs, ranges, 2);
+	}
+
+	// Solve an expression on a grid of samples over a box, which must all lie in its bound unless the bound is NaN
+	// Returns whether any sample is NaN
+	bool sample(const char* source, Interval x, Interval y, ExprUtil::Accuracy accuracy) {
+		ExprUtil::ExprFloat expression;
+		expression.accuracy = accuracy;
+		expression.set(source);
+		ExprUtil::ExprFloat::Slot slotX = expression.bind("x");
+		ExprUtil::ExprFloat::Slot slotY = expression.bind("y");
+		ExprUtil::ExprFloat::Slot inputs[2] = { slotX, slotY };
+		Interval ranges[2] = { x, y };
+		ExprUtil::ExprFloat::Context context = expression.makeContext();
+		Interval range = expression.solveInterval(context, inputs, ranges, 2);
+		bool nan = false;
+		const int steps = 16;
+		for (int i = 0; i <= steps; i++) {
+			for (int j = 0; j <= steps; j++) {
+				context.slots[slotX] = x.lo + (x.hi - x.lo) * i / steps;
+				context.slots[slotY] = y.lo + (y.hi - y.lo) * j / steps;
+				float value = expression.solve(context);
+				nan = nan || std::isnan(value);
+				if (!std::isnan(range.lo)) {
+					Tests::check(!std::isnan(value) && range.lo <= value && value <= range.hi,
+						std::string(source) + " at x = " + std::to_string(context.slots[slotX]) + ", y = "
+						+ std::to_string(context.slots[slotY]) + " lies in its bound");
+				}
+			}
+		}
+		return nan;
+	}
+}
+
+// Ranges from solveInterval() hold every value and are NaN wherever a value may be NaN
+void Tests::interval() {
+	const float inf = std::numeric_limits<float>::infinity();
+	// Boxes whose samples include NaN must not get finite bounds, Graph::solveTile() would fill them flat
+	const char* nans[] = {
+		"sin((y+3)*exp(x)/x)/(-2)",
+		"cos(log(0)+x)",
+		"cos(0^x)+y",
+		"tan(1/x)",
+		"sqrt(x)*y",
+		"(x/x)*y"
+	};
+	for (const char* source : nans) {
+		for (ExprUtil::Accuracy accuracy : { ExprUtil::Accuracy::Exact, ExprUtil::Accuracy::Fast }) {
+			Interval range = bound(source, { -1, 1 }, { -1, 1 }, accuracy);
+			check(sample(source, { -1, 1 }, { -1, 1 }, accuracy), std::string(source) + " is NaN somewhere in the box");
+			check(std::isnan(range.lo) && std::isnan(range.hi), std::string(source) + " is bounded by NaN");
+		}
+	}
+	// Arithmetic that reaches inf - inf, 0 * inf or inf / inf inside the box
+	check(std::isnan(bound("x+y", { 0, inf }, { -inf, 0 }).lo), "inf + -inf is bounded by NaN");
+	check(std::isnan(bound("x-y", { 0, inf }, { 0, inf }).lo), "inf - inf is bounded by NaN");
+	check(std::isnan(bound("x*y", { -1, 1 }, { 1, inf }).lo), "0 * inf is bounded by NaN");
+	check(std::isnan(bound("x/y", { 1, inf }, { 1, inf }).lo), "inf / inf is bounded by NaN");
+	check(std::isnan(bound("sin(x)", { 0, inf }, { 0, 0 }).lo), "sin(inf) is bounded by NaN");
+	check(std::isnan(bound("cos(x)", { -inf, 0 }, { 0, 0 }).lo), "cos(-inf) is bounded by NaN");
+	// A square is never 0 * inf
+	Interval square = bound("x*x", { -1, inf }, { 0, 0 });
+	check(square.lo == 0 && square.hi == inf, "x*x over [-1, inf] is bounded by [0, inf]");
+	// Finite expressions keep finite bounds that hold every sample
+	const char* finite[] = {
+		"sin(x)*y",
+		"x^2/(1+y*y)",
+		"exp(-x*x-y*y)*cos(3*x)",
+		"abs(x-y)+sqrt(x*x+1)",
+		"atan2(y, x)+min(x, y)"
+	};
+	for (const char* source : finite) {
+		for (ExprUtil::Accuracy accuracy : { ExprUtil::Accuracy::Exact, ExprUtil::Accuracy::Fast }) {
+			Interval range = bound(source, { -2, 3 }, { -1, 2 }, accuracy);
+			check(!sample(source, { -2, 3 }, { -1, 2 }, accuracy), std::string(source) + " is a number everywhere in the box");
+			check(std::isfinite(range.lo) && std::isfinite(range.hi), std::string(source) + " has a finite bound");
+		}
+	}
+}
@@ -0,0 +1,43 @@
+// STD
+#include <iostream>
+#include <string>
+// User
+#include "tests.hpp"
+
+namespace {
+	int checks = 0;
+	int failures = 0;
+}
+
+// Record a check
+void Tests::check(bool condition, const std::string& what) {
+	checks++;
+	if (!condition) {
+		failures++;
+		std::cout << "FAILED: " << what << "\n";
+	}
+}
+
+// Run the tests named on the command line, or all of them, and fail if any check fails
+// e.g. Tests interval
+int main(int argc, char* argv[]) {
+	struct Entry {
+		const char* name;
+		void(*run)();
+	};
+	const Entry tests[] = {
+		{ "interval", Tests::interval },
+		{ "gradient", Tests::gradient }
+	};
+	for (const Entry& entry : tests) {
+		bool selected = argc < 2;
+		for (int i = 1; i < argc; i++) {
+			selected = selected || entry.name == std::string(argv[i]);
+		}
+		if (selected) {
+			entry.run();
+		}
+	}
+	std::cout << checks - failures << " of " << checks << " checks passed\n";
+	return failures == 0 ? 0 : 1;
+}
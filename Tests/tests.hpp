@@ -0,0 +1,19 @@
+#ifndef TESTS_H
+#define TESTS_H
+
+// STD
+#include <string>
+
+namespace Tests {
+
+	// Record a check, printing what was expected if it does not hold
+	void check(bool condition, const std::string& what);
+
+	// Tests, each records its checks through check()
+	// Ranges from solveInterval() hold every value solve() gives in the box, and are NaN wherever a value may be NaN
+	void interval();
+	// Heights solveGrid() gives natively match the interpreter exactly, and their gradients match it up to rounding and the error of Accuracy::Fast
+	void gradient();
+}
+
+#endif